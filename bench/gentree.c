@@ -0,0 +1,174 @@
+/*
+ * gentree - reproducible directory trees for the lsv benchmarks
+ *
+ * Usage: gentree flat  <dir> <files>
+ *        gentree deep  <dir> <depth>
+ *        gentree wide  <dir> <fanout> <levels>
+ *        gentree mixed <dir> <entries>
+ *
+ * Names, sizes, modes and timestamps come from a fixed-seed generator,
+ * so the same arguments always produce the same tree. A hidden stamp
+ * file records the arguments; run_bench.sh uses it to skip trees that
+ * already exist.
+ */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define STAMP_NAME ".gentree-stamp-2" // new name whenever a shape changes
+#define BASE_TIME  1704067200   // 2024-01-01 00:00:00 UTC
+
+unsigned long long rng_state = 12345;
+
+// ================== Deterministic Generator ==================
+unsigned int rng(void) {
+    rng_state = rng_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int)(rng_state >> 33);
+}
+
+void die(const char *what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+void make_dir(const char *path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST)
+        die(path);
+}
+
+// Regular file with a pseudo-random (sparse) size and mtime.
+void make_file(const char *path, mode_t mode) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd == -1) die(path);
+    if (ftruncate(fd, rng() % (1 << 20)) == -1) die("ftruncate");
+    close(fd);
+
+    struct timespec ts[2];
+    ts[0].tv_sec = ts[1].tv_sec = BASE_TIME + rng() % (3 * 365 * 86400);
+    ts[0].tv_nsec = ts[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, path, ts, 0);
+}
+
+// ================== Tree Shapes ==================
+// One directory with n files.
+void gen_flat(const char *dir, long n) {
+    char path[4096];
+    make_dir(dir);
+    for (long i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/file_%08x_%07ld.dat", dir, rng(), i);
+        make_file(path, 0644);
+    }
+}
+
+// A chain of depth nested directories with a few files at every level.
+// Built with relative paths so the chain can go past PATH_MAX.
+void gen_deep(const char *dir, int depth) {
+    char name[32];
+    int cwd = open(".", O_RDONLY | O_DIRECTORY);
+    if (cwd == -1) die(".");
+
+    make_dir(dir);
+    if (chdir(dir) == -1) die(dir);
+    for (int d = 0; d < depth; d++) {
+        for (int f = 0; f < 4; f++) {
+            snprintf(name, sizeof(name), "f%d", f);
+            make_file(name, 0644);
+        }
+        snprintf(name, sizeof(name), "level_%04d", d);
+        make_dir(name);
+        if (chdir(name) == -1) die(name);
+    }
+
+    if (fchdir(cwd) == -1) die("fchdir");
+    close(cwd);
+}
+
+// fanout subdirectories per directory, levels deep, 8 files in each.
+void gen_wide(const char *dir, int fanout, int levels) {
+    char path[4096];
+    make_dir(dir);
+    for (int f = 0; f < 8; f++) {
+        snprintf(path, sizeof(path), "%s/file_%d.txt", dir, f);
+        make_file(path, 0644);
+    }
+    if (levels == 0) return;
+    for (int i = 0; i < fanout; i++) {
+        snprintf(path, sizeof(path), "%s/dir_%03d", dir, i);
+        gen_wide(path, fanout, levels - 1);
+    }
+}
+
+// Every entry type the color and long-listing code cares about.
+void gen_mixed(const char *dir, long n) {
+    static const char *exts[] = { ".c", ".txt", ".tar", ".gz", ".zip", ".log", "" };
+    char path[4096], target[4096];
+    unsigned char *ext_of = malloc(n > 0 ? n : 1);   // exts index of each entry
+    if (!ext_of) die("malloc");
+
+    make_dir(dir);
+    for (long i = 0; i < n; i++) {
+        unsigned int r = rng() % 100;
+        ext_of[i] = rng() % (sizeof(exts) / sizeof(exts[0]));
+        snprintf(path, sizeof(path), "%s/entry_%07ld%s", dir, i, exts[ext_of[i]]);
+
+        if (r < 60) {
+            make_file(path, 0644);
+        } else if (r < 70) {
+            make_file(path, 0755);
+        } else if (r < 80) {
+            make_dir(path);
+        } else if (r < 90) {
+            // Half point at earlier entries, half dangle.
+            if (i > 0 && r < 85) {
+                long t = rng() % i;
+                snprintf(target, sizeof(target), "entry_%07ld%s", t, exts[ext_of[t]]);
+            } else
+                snprintf(target, sizeof(target), "missing_%u", rng());
+            if (symlink(target, path) == -1 && errno != EEXIST) die(path);
+        } else {
+            if (mkfifo(path, 0644) == -1 && errno != EEXIST) die(path);
+        }
+    }
+    free(ext_of);
+}
+
+// ================== Main ==================
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s flat|deep|mixed <dir> <n>\n"
+                        "       %s wide <dir> <fanout> <levels>\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *shape = argv[1], *dir = argv[2];
+    long n = atol(argv[3]);
+
+    if (strcmp(shape, "flat") == 0)
+        gen_flat(dir, n);
+    else if (strcmp(shape, "deep") == 0)
+        gen_deep(dir, (int)n);
+    else if (strcmp(shape, "wide") == 0 && argc >= 5)
+        gen_wide(dir, (int)n, atoi(argv[4]));
+    else if (strcmp(shape, "mixed") == 0)
+        gen_mixed(dir, n);
+    else {
+        fprintf(stderr, "gentree: unknown shape '%s'\n", shape);
+        return EXIT_FAILURE;
+    }
+
+    char stamp[4096];
+    snprintf(stamp, sizeof(stamp), "%s/" STAMP_NAME, dir);
+    FILE *fp = fopen(stamp, "w");
+    if (!fp) die(stamp);
+    for (int i = 1; i < argc; i++)
+        fprintf(fp, "%s%s", argv[i], i + 1 < argc ? " " : "\n");
+    fclose(fp);
+    return 0;
+}
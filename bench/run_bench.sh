@@ -0,0 +1,119 @@
+#!/bin/sh
+# ==========================
+#  Benchmark harness for every bin/lsv version
+#  Run through "make bench"; all settings can be overridden from the
+#  environment (or as make variables).
+# ==========================
+
+BIN_DIR=${BIN_DIR:-bin}
+BENCH_BIN=${BENCH_BIN:-bench}
+BENCH_DIR=${BENCH_DIR:-/tmp/lsv-bench}
+BENCH_FLAT=${BENCH_FLAT:-1000000}          # files in the flat directory
+BENCH_DEEP=${BENCH_DEEP:-500}              # levels in the deep chain
+BENCH_WIDE_FANOUT=${BENCH_WIDE_FANOUT:-12} # subdirectories per directory
+BENCH_WIDE_LEVELS=${BENCH_WIDE_LEVELS:-3}
+BENCH_MIXED=${BENCH_MIXED:-100000}         # entries in the mixed directory
+BENCH_RUNS=${BENCH_RUNS:-3}                # warm runs, best one is reported
+BENCH_VERSIONS=${BENCH_VERSIONS:-"1.1.0 1.2.0 1.3.0 1.4.0 1.5.0 1.6.0"}
+BENCH_OUT=${BENCH_OUT:-bench_output.txt}
+
+GENTREE=$BENCH_BIN/gentree
+RUNSTAT=$BENCH_BIN/runstat
+
+# Modes each release understands ("-" is the default listing).
+modes_for() {
+    case $1 in
+        1.1.0) echo "- -l" ;;
+        1.2.0) echo "-" ;;
+        1.3.0|1.4.0|1.5.0) echo "- -l -x" ;;
+        *) echo "- -l -x -R" ;;
+    esac
+}
+
+# ---------- Trees ----------
+# Regenerate a tree only if its stamp does not match the parameters.
+# The stamp is renamed (STAMP_NAME in gentree.c) when a shape changes.
+make_tree() {
+    name=$1; shape=$2; shift 2
+    dir=$BENCH_DIR/$name
+    if [ "$(cat "$dir/.gentree-stamp-2" 2>/dev/null)" != "$shape $dir $*" ]; then
+        echo "generating $name tree..." >&2
+        rm -rf "$dir"
+        "$GENTREE" "$shape" "$dir" "$@" || exit 1
+    fi
+}
+
+mkdir -p "$BENCH_DIR" || exit 1
+make_tree flat  flat  "$BENCH_FLAT"
+make_tree deep  deep  "$BENCH_DEEP"
+make_tree wide  wide  "$BENCH_WIDE_FANOUT" "$BENCH_WIDE_LEVELS"
+make_tree mixed mixed "$BENCH_MIXED"
+
+# ---------- Measurement ----------
+can_drop_caches() {
+    [ -w /proc/sys/vm/drop_caches ]
+}
+
+drop_caches() {
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+}
+
+# Prints "wall user sys maxrss" (ms, ms, ms, KiB) for one run.
+measure() {
+    "$RUNSTAT" "$@" 2>&1 >/dev/null | tail -n 1 | cut -d' ' -f1-4
+}
+
+# Syscalls made by one run, or "n/a" without strace.
+count_syscalls() {
+    if command -v strace >/dev/null 2>&1; then
+        trace=$(mktemp)
+        strace -f -o "$trace" "$@" >/dev/null 2>&1
+        grep -cv -e '^[0-9]* *+++' -e '^[0-9]* *---' "$trace"
+        rm -f "$trace"
+    else
+        echo n/a
+    fi
+}
+
+if ! can_drop_caches; then
+    echo "note: cannot write /proc/sys/vm/drop_caches (needs root); cold runs skipped" >&2
+fi
+
+{
+    printf "%-6s %-8s %-4s %-5s %10s %10s %10s %10s %10s\n" \
+        tree version mode cache wall_ms user_ms sys_ms maxrss_kb syscalls
+    for tree in flat deep wide mixed; do
+        dir=$BENCH_DIR/$tree
+        for v in $BENCH_VERSIONS; do
+            bin=$BIN_DIR/lsv$v
+            [ -x "$bin" ] || continue
+            for mode in $(modes_for "$v"); do
+                if [ "$mode" = "-" ]; then set -- "$bin" "$dir"; else set -- "$bin" "$mode" "$dir"; fi
+                # -R on the flat tree is the same work as the plain listing.
+                [ "$mode" = "-R" ] && [ "$tree" = flat ] && continue
+
+                calls=$(count_syscalls "$@")
+
+                if can_drop_caches; then
+                    drop_caches
+                    printf "%-6s %-8s %-4s %-5s %10s %10s %10s %10s %10s\n" \
+                        "$tree" "$v" "$mode" cold $(measure "$@") "$calls"
+                fi
+
+                "$RUNSTAT" "$@" >/dev/null 2>&1
+                best=""
+                i=0
+                while [ $i -lt "$BENCH_RUNS" ]; do
+                    run=$(measure "$@")
+                    if [ -z "$best" ] || [ "$(echo "$run $best" | awk '{print ($1 < $5)}')" = 1 ]; then
+                        best=$run
+                    fi
+                    i=$((i + 1))
+                done
+                printf "%-6s %-8s %-4s %-5s %10s %10s %10s %10s %10s\n" \
+                    "$tree" "$v" "$mode" warm $best "$calls"
+            done
+        done
+    done
+} | tee "$BENCH_OUT"
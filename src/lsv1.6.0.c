@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE
 #define _XOPEN_SOURCE 700
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,10 +7,34 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <stdarg.h>
+#include <locale.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <poll.h>
+#include <fnmatch.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/sysmacros.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+#ifndef AT_STATX_DONT_SYNC
+#define AT_STATX_DONT_SYNC 0x4000   // linux/fcntl.h; glibc only exports it with _GNU_SOURCE
+#endif
+#endif
 
 extern int errno;
 
@@ -17,41 +42,540 @@ extern int errno;
 #define DISPLAY_DEFAULT 0
 #define DISPLAY_LONG 1
 #define DISPLAY_HORIZONTAL 2
+#define DISPLAY_JSON 3          // --json: one array of records
+#define DISPLAY_NDJSON 4        // --ndjson: one record per line
 
-// ================== ANSI Color Codes ==================
-#define COLOR_RESET     "\033[0m"
-#define COLOR_BLUE      "\033[0;34m"
-#define COLOR_GREEN     "\033[0;32m"
-#define COLOR_RED       "\033[0;31m"
-#define COLOR_PINK      "\033[0;35m"
-#define COLOR_REVERSE   "\033[7m"
+// How much of the stat information a listing needs
+#define STAT_COLOR 1   // file type plus the executable bits
+#define STAT_FULL  2   // everything shown by -l
+
+// Sort keys
+#define SORT_NAME 0
+#define SORT_TIME 1     // -t: newest first
+#define SORT_SIZE 2     // -S: largest first
+
+// ================== Column Layout ==================
+#define MIN_COLUMN_WIDTH 3      // one character plus the two-space gap
+
+struct column_layout {
+    int cols, rows;
+    int *widths;                // widths[c]: column c, gap included
+};
+
+// ================== Colors (LS_COLORS) ==================
+// LS_COLORS ("di=01;34:ln=01;36:*.tar=01;31:...") is parsed once at
+// startup on top of the built-in colors. Two-letter type keys fill a
+// table indexed by CT_* (ln=target instead colors links by what they
+// point to); "*suffix" keys go into a hash keyed by the
+// suffix, so coloring a file costs one probe per '.' in its name no
+// matter how many extensions are configured.
+#define DEFAULT_TYPE_COLORS "fi=0:di=0;34:ln=0;35:ex=0;32:pi=7:so=7:bd=7:cd=7:rs=0"
+#define DEFAULT_EXT_COLORS  "*.tar=0;31:*.gz=0;31:*.zip=0;31"   // only without LS_COLORS
+
+enum {
+    CT_FILE, CT_DIR, CT_LINK, CT_FIFO, CT_SOCK, CT_BLK, CT_CHR, CT_EXEC,
+    CT_SETUID, CT_SETGID, CT_STICKY, CT_OTHER_WRITABLE, CT_STICKY_OTHER_WRITABLE,
+    CT_RESET,
+    CT_COUNT
+};
+
+struct color_seq {
+    char *seq;              // complete escape sequence, NULL: uncolored
+    int len;
+};
+
+struct color_ext {
+    char *suffix;           // NULL: empty slot
+    int len;
+    struct color_seq color;
+};
+
+struct color_table {
+    struct color_seq types[CT_COUNT];
+    struct color_ext *exts; // open addressing, power-of-two capacity
+    size_t ext_cap, ext_count;
+    int *odd_lens;          // lengths of suffixes not starting with '.'
+    int nodd;
+    int dir_modes;          // st/ow/tw are set: directories need a stat
+    int link_target;        // ln=target: links take their target's color
+};
+
+struct color_table colors;
+
+// One record per directory entry. It is filled by gather_filenames and
+// stat_entries once per directory and then shared by the color, long
+// listing and recursion code, so no file is lstat'ed more than once.
+struct file_entry {
+    char *name;         // points into the listing's name arena
+    size_t name_off;    // offset of name in the arena while it still grows
+    int len;
+    const char *key;    // what the sort engine orders by: name, or its
+    int key_len;        // strxfrm transform with --collate
+    int has_xfrm;       // key lives at key_off in the arena
+    size_t key_off;
+    unsigned char d_type;
+    int have_stat;      // the fields below come from lstat
+    mode_t mode;        // S_IFMT bits are valid even without lstat if d_type was known
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;    // -t breaks ties within a second on it
+    uid_t uid;
+    gid_t gid;
+    nlink_t nlink;
+    ino_t ino;
+    dev_t dev;
+    const struct color_seq *link_color; // ln=target: the target's color, NULL if dangling
+};
+
+// All entries of one directory. Names are bump-allocated back to back in
+// a single arena, so a finished listing is released with two frees no
+// matter how many entries it had.
+struct dir_listing {
+    struct file_entry *files;
+    int count, cap;
+    char *names;
+    size_t names_used, names_cap;
+};
+
+// ================== Recursive Walk ==================
+// -R walks with an explicit stack of frames rather than recursion, so
+// the depth of a tree is bounded by memory, not by the C stack. The
+// (dev, ino) of every directory on the current path is kept in a hash
+// set; meeting one of them again (a bind mount of an ancestor, say)
+// is reported instead of looping.
+struct dir_id {
+    dev_t dev;
+    ino_t ino;
+};
+
+struct dir_id_set {
+    struct dir_id *ids;
+    char *used;
+    size_t cap, count;          // cap is a power of two
+};
+
+struct dir_frame {
+    int fd;                     // -1 once the last subdirectory is open
+    char *path;
+    struct dir_listing subdirs; // still to visit, from next on
+    int next;
+    int depth;                  // 0 for the command-line directory
+    struct dir_id id;
+};
+
+struct dir_stack {
+    struct dir_frame *frames;
+    int count, cap;
+    struct dir_id_set active;   // ids of the frames
+};
+
+int max_depth = -1;             // --max-depth, -1: no limit
+char **prune_patterns;          // --prune: subdirectories not descended into
+int nprune;
+
+// ================== Directory Index ==================
+// --build-index writes a snapshot of a whole tree to a file;
+// --from-index maps it and serves every directory whose mtime still
+// matches straight from the map, skipping getdents and lstat. The file
+// is native-endian and laid out as
+//   index_header | index_dir[ndirs] | index_entry[nentries] | strings
+// with the directories sorted by path and every directory's entries
+// stored contiguously in getdents order. Strings are NUL-terminated.
+#define INDEX_MAGIC "LSVIDX02"
+
+struct index_header {
+    char magic[8];
+    uint64_t ndirs, nentries, strings_size;
+};
+
+struct index_dir {
+    uint64_t path_off;          // the path as -R prints it
+    uint32_t path_len, nentries;
+    uint64_t first;             // index of its first entry
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t ino, dev;
+};
+
+struct index_entry {
+    uint64_t name_off;
+    uint32_t name_len, mode;
+    uint32_t uid, gid;
+    uint32_t have_stat, d_type;
+    int64_t size, mtime, mtime_nsec;
+    uint64_t nlink, ino, dev;
+};
+
+struct dir_index {
+    const struct index_dir *dirs;
+    const struct index_entry *entries;
+    const char *strings;
+    uint64_t ndirs, nentries;
+};
+
+struct dir_index *active_index;     // --from-index
+
+// ================== Directory Reader ==================
+// On Linux directories are read with getdents64 straight into a large
+// buffer and the records are parsed in place: name, length, d_type and
+// inode are exposed without copying. Elsewhere it falls back to readdir.
+#define DIRBUF_DEFAULT (1024 * 1024)
+
+size_t dirbuf_size = DIRBUF_DEFAULT;  // --dirbuf
+
+struct dir_record {
+    const char *name;   // points into the reader's buffer
+    int len;
+    unsigned char d_type;
+    ino_t ino;
+};
+
+#ifdef __linux__
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dir_reader {
+    int fd;
+    char *buf;
+    size_t pos, len;
+};
+
+// One buffer per thread, reused for every directory it reads.
+__thread char *dirbuf;
+__thread size_t dirbuf_alloc;
+#else
+struct dir_reader {
+    DIR *dp;
+};
+#endif
+
+// ================== Batched statx (io_uring) ==================
+// With --uring a directory's entries are stat'ed through an io_uring
+// instead of one blocking fstatat after another. Every thread maps its
+// own ring on first use; the rings are driven with the raw syscalls.
+#define URING_DEPTH 256     // statx requests in flight per thread
+
+#ifdef __linux__
+struct uring {
+    int ready;              // mapped and usable
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+    unsigned entries;
+};
+
+__thread struct uring ring;
+#endif
+
+int use_uring = 0;          // --uring
+int uring_broken = 0;       // setup failed once: stay with fstatat
+
+// statx flags added to every stat: --dont-sync sets AT_STATX_DONT_SYNC,
+// letting NFS/CIFS answer from cached attributes instead of asking the
+// server again. Local filesystems ignore it.
+int stat_sync = 0;
+int statx_missing = 0;      // kernel without statx: use fstatat
+
+// ================== Stat Thread Pool ==================
+// Big directories on slow filesystems spend their time waiting for one
+// stat after another. The pool runs those stats on several threads,
+// each claiming STAT_POOL_CHUNK records at a time and writing the
+// results straight into the listing's array, which is sorted afterwards
+// as usual. By default the pool size comes from the first
+// STAT_POOL_SAMPLE stats: the online CPUs times wall time over CPU time,
+// i.e. enough threads to keep every CPU busy while the rest wait on the
+// filesystem. Stats that never block get one thread per CPU (serial on
+// a single CPU); NFS round-trips get up to STAT_POOL_MAX.
+#define STAT_POOL_MIN    1024   // entries before the pool is considered
+#define STAT_POOL_SAMPLE 32     // stats timed to size the pool
+#define STAT_POOL_CHUNK  64     // records a thread claims at once
+#define STAT_POOL_MAX    32     // threads
+
+struct stat_pool {
+    int dirfd, need, count;
+    struct file_entry *files;
+    int next;               // first record not claimed yet
+};
+
+int stat_threads = 0;   // --stat-threads, 0: size from measured latency, 1: off
+
+// ================== Output Buffer ==================
+// All listing output is formatted straight into an outbuf. One backed by
+// a descriptor is flushed with write/writev when it fills up; one with
+// fd == -1 just grows in memory (used for the -j per-directory blocks).
+#define OUTBUF_SIZE (256 * 1024)
+
+struct outbuf {
+    int fd;
+    char *buf;
+    size_t len, cap;
+};
+
+struct outbuf stdout_buf;
+__thread long json_records;     // --json records in the stream being written
+
+// ================== Timestamp Cache ==================
+// -l used to call ctime per line, which re-checks the timezone and does
+// full date formatting into a static buffer. Timestamps are now
+// formatted by hand: the local day containing the last timestamp is
+// remembered per thread, so entries from the same day only need the
+// hour and minute worked out. Days with a DST switch are not cached.
+#define SIX_MONTHS (31556952 / 2)   // seconds, as GNU ls counts them
+
+struct time_cache {
+    time_t day_start, day_end;  // [start, end) of the cached local day
+    char day[6];                // "Mmm dd"
+    int year;
+};
+
+__thread struct time_cache mtime_cache;
+time_t now_time;                // set once at startup
+
+// ================== User/Group Name Cache ==================
+// getpwuid/getgrgid can mean an NSS round-trip (sssd, LDAP) per call.
+// Every id is resolved once per process and remembered, including ids
+// that have no name. The cache is shared by all directories of a -R
+// walk and by all -j workers.
+struct id_cache_slot {
+    unsigned int id;
+    int used;
+    char *name;             // NULL: id has no passwd/group entry
+};
+
+struct id_cache {
+    struct id_cache_slot *slots;
+    size_t cap, count;
+    long hits, misses;
+};
+
+struct id_cache user_cache, group_cache;
+pthread_mutex_t id_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ================== Profiling (--stats) ==================
+// With --stats every phase of a run is timed with CLOCK_MONOTONIC and
+// summarized on stderr at exit, so a slow listing can be pinned on the
+// filesystem (read, stat), NSS (nss) or the output side (layout,
+// format, write). Counters are per thread and merged into prof_total
+// when a -j worker exits; without --stats the hooks return right away.
+#define PROF_READ   0   // openat + getdents64
+#define PROF_STAT   1   // statx (fstatat without it)
+#define PROF_NSS    2   // getpwuid/getgrgid on a cache miss
+#define PROF_SORT   3   // collate keys, sort, --head selection
+#define PROF_LAYOUT 4   // column output (display_default, display_horizontal)
+#define PROF_FORMAT 5   // -l lines, NSS lookups included
+#define PROF_WRITE  6   // write/writev to stdout
+#define PROF_PHASES 7
+
+#define STAT_BUCKETS 24 // <1us, then powers of two up to ~4s
+
+struct profile {
+    uint64_t ns[PROF_PHASES];
+    long calls[PROF_PHASES];
+    long opens, getdents;           // the two halves of PROF_READ
+    long dirs, entries;
+    long index_hits, index_misses;  // --from-index
+    long uring_stats, uring_enters; // --uring: statx requests, io_uring_enter calls
+    long fstats;                    // fstat of open directories (-R, --from-index)
+    long long bytes;                // written to stdout
+    long stat_hist[STAT_BUCKETS];
+    long pooled_dirs;               // directories stat'ed by the thread pool
+    int pool_threads;               // largest pool used
+    int threads;                    // prof_total: threads merged in
+};
+
+__thread struct profile prof;
+struct profile prof_total;
+pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t prof_run_start;
+
+int show_stats = 0;     // --stats, --profile
+int unsorted = 0;       // -U/-f: stream entries in directory order
+int collate = 0;        // --collate: sort in locale (LC_COLLATE) order
+int sort_threads = 0;   // --sort-threads, 0: one per online CPU
+long parallel_sort_min = 200000;  // --parallel-sort-min
+int sort_by = SORT_NAME;          // -t, -S
+long head_limit = 0;              // --head: entries shown per directory, 0 = all
+int show_all = 0;       // -f: include dot files
+int term_width = 0;     // set by the daemon for each client; 0: ask stdout
 
 // Function prototypes
-int gather_filenames(const char *dir, char ***filenames, int *count, int *maxlen);
-void display_default(char **files, int count, int maxlen, const char *dir);
-void display_horizontal(char **files, int count, int maxlen, const char *dir);
-void display_long(const char *dir);
+int open_dir_at(int parent_fd, const char *name);
+char *join_path(const char *dir, const char *name);
+int dir_reader_open(struct dir_reader *r, int dirfd);
+int dir_reader_next(struct dir_reader *r, struct dir_record *rec);
+void dir_reader_close(struct dir_reader *r);
+int dir_reader_pending(struct dir_reader *r);
+void dir_reader_free_buffer(void);
+size_t arena_add_name(struct dir_listing *list, const char *name, int len);
+void listing_append(struct dir_listing *list, const struct file_entry *f);
+void listing_finish(struct dir_listing *list);
+void collate_keys(struct dir_listing *list);
+void entry_from_record(struct file_entry *f, const struct dir_record *rec);
+int is_listed(const char *name);
+int is_subdir(const struct file_entry *f);
+int gather_filenames(int dirfd, struct dir_listing *list);
+void free_listing(struct dir_listing *list);
+void stat_entries(int dirfd, struct file_entry *files, int count, int need);
+int stat_entry(int dirfd, struct file_entry *file, int need);
+void resolve_link_color(int dirfd, struct file_entry *f);
+int uring_stat_entries(int dirfd, struct file_entry *files, int count, int need);
+void uring_free(void);
+void ob_init(struct outbuf *ob, int fd);
+void ob_flush(struct outbuf *ob);
+void ob_free(struct outbuf *ob);
+void ob_write(struct outbuf *ob, const char *s, size_t n);
+void ob_puts(struct outbuf *ob, const char *s);
+void ob_putc(struct outbuf *ob, char c);
+void ob_pad(struct outbuf *ob, int n);
+void ob_printf(struct outbuf *ob, const char *fmt, ...);
+void ob_mode(struct outbuf *ob, mode_t mode);
+void ob_num(struct outbuf *ob, long value, int width);
+void ob_str_left(struct outbuf *ob, const char *s, int width);
+void format_mtime(char buf[12], time_t t);
+const char *user_name(uid_t uid);
+const char *group_name(gid_t gid);
+uint64_t clock_ns(void);
+uint64_t thread_cpu_ns(void);
+uint64_t prof_start(void);
+void prof_end(int phase, uint64_t start);
+void prof_stat_latency(uint64_t ns);
+void prof_merge(void);
+void print_stats(void);
+void plan_columns(struct column_layout *lay, const struct file_entry *files, int count,
+                  int width, int by_columns);
+void display_default(struct outbuf *out, struct file_entry *files, int count);
+void display_horizontal(struct outbuf *out, struct file_entry *files, int count);
+void display_long(struct outbuf *out, struct file_entry *files, int count);
+void print_long_entry(struct outbuf *out, const struct file_entry *f);
 int get_terminal_width();
-int cmp_str(const void *a, const void *b);
-int get_file_mode(const char *dir, const char *filename, mode_t *mode);
-void print_colored_file(const char *dir, const char *filename);
+void sort_entries(struct dir_listing *list);
+void sort_listing(struct dir_listing *list);
+int stat_need(int display_mode);
+mode_t dtype_to_mode(unsigned char d_type);
+void init_colors(void);
+const struct color_seq *color_for(const struct file_entry *f);
+void print_colored_file(struct outbuf *out, const struct file_entry *file);
+int is_json(int display_mode);
+void ob_json_escape(struct outbuf *out, const char *s, size_t len);
+void print_json_entry(struct outbuf *out, const char *dir, const struct file_entry *f,
+                      int display_mode);
+void display_json(struct outbuf *out, const char *dir, struct file_entry *files, int count,
+                  int display_mode);
+int list_directory(struct outbuf *out, int dirfd, const char *path, int display_mode,
+                   struct dir_listing *list);
+int stream_directory(struct outbuf *out, int dirfd, const char *path, int display_mode,
+                     struct dir_listing *subdirs);
+int render_directory(struct outbuf *out, int dirfd, const char *path, int display_mode,
+                     struct dir_listing *list);
+void show_listing(struct outbuf *out, const char *path, int display_mode,
+                  struct dir_listing *list);
+void display_entries(struct outbuf *out, const char *path, int display_mode,
+                     struct file_entry *files, int count);
+void keep_subdirs(struct dir_listing *list);
+int is_pruned(const char *name);
+int dir_id_add(struct dir_id_set *s, struct dir_id id);
+void dir_id_remove(struct dir_id_set *s, struct dir_id id);
+int dir_id_of(int fd, struct dir_id *id);
+void push_frame(struct dir_stack *st, int fd, char *path, struct dir_listing *subdirs,
+                int depth, struct dir_id id);
+const struct file_entry *frame_next(struct dir_frame *f);
+void frame_release(struct dir_frame *f);
+void free_dir_stack(struct dir_stack *st);
+void report_cycle(const char *path);
 void do_ls(const char *dir, int display_mode);
+void do_ls_parallel(const char *dir, int display_mode, int jobs);
+int build_index(const char *file, const char *root);
+struct dir_index *open_index(const char *file);
+int index_listing(int dirfd, const char *path, struct dir_listing *list);
+int run_daemon(const char *socket_path);
+int daemon_query(const char *socket_path, const char *dir, int display_mode);
+
+// ================== Main ==================
+// Long options have no short form; they use values past the char range.
+enum {
+    OPT_DIRBUF = 256,
+    OPT_STATS,
+    OPT_COLLATE,
+    OPT_SORT_THREADS,
+    OPT_PARALLEL_SORT_MIN,
+    OPT_HEAD,
+    OPT_JSON,
+    OPT_NDJSON,
+    OPT_BUILD_INDEX,
+    OPT_FROM_INDEX,
+    OPT_DAEMON,
+    OPT_SOCKET,
+    OPT_URING,
+    OPT_DONT_SYNC,
+    OPT_STAT_THREADS,
+    OPT_MAX_DEPTH,
+    OPT_PRUNE,
+};
 
-// ================== Comparison Function ==================
-int cmp_str(const void *a, const void *b) {
-    const char * const *str1 = (const char * const *)a;
-    const char * const *str2 = (const char * const *)b;
-    return strcmp(*str1, *str2);
+struct option long_options[] = {
+    {"dirbuf", required_argument, NULL, OPT_DIRBUF},
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"profile", no_argument, NULL, OPT_STATS},
+    {"collate", no_argument, NULL, OPT_COLLATE},
+    {"sort-threads", required_argument, NULL, OPT_SORT_THREADS},
+    {"parallel-sort-min", required_argument, NULL, OPT_PARALLEL_SORT_MIN},
+    {"head", required_argument, NULL, OPT_HEAD},
+    {"json", no_argument, NULL, OPT_JSON},
+    {"ndjson", no_argument, NULL, OPT_NDJSON},
+    {"build-index", required_argument, NULL, OPT_BUILD_INDEX},
+    {"from-index", required_argument, NULL, OPT_FROM_INDEX},
+    {"daemon", required_argument, NULL, OPT_DAEMON},
+    {"socket", required_argument, NULL, OPT_SOCKET},
+    {"uring", no_argument, NULL, OPT_URING},
+    {"dont-sync", no_argument, NULL, OPT_DONT_SYNC},
+    {"stat-threads", required_argument, NULL, OPT_STAT_THREADS},
+    {"max-depth", required_argument, NULL, OPT_MAX_DEPTH},
+    {"prune", required_argument, NULL, OPT_PRUNE},
+    {NULL, 0, NULL, 0}
+};
+
+// "65536", "64K" or "1M"
+size_t parse_size(const char *arg) {
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (*end == 'K' || *end == 'k') n <<= 10;
+    else if (*end == 'M' || *end == 'm') n <<= 20;
+    return (size_t)n;
+}
+
+// A whole number in [min, max] for option opt; anything else is a typo
+// that would otherwise turn into some default, so it ends the run.
+long parse_count(const char *prog, const char *opt, const char *arg, long min, long max) {
+    char *end;
+    errno = 0;
+    long n = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || n < min || n > max) {
+        fprintf(stderr, "%s: invalid %s count '%s'\n", prog, opt, arg);
+        exit(EXIT_FAILURE);
+    }
+    return n;
 }
 
-// ================== Main ==================
 int main(int argc, char *argv[]) {
     int opt;
     int display_mode = DISPLAY_DEFAULT;
     int recursive_flag = 0; // New flag for -R
+    int jobs = 1;           // -j N: worker threads for -R
+    const char *index_out = NULL;   // --build-index
+    const char *index_in = NULL;    // --from-index
+    const char *daemon_socket = NULL;   // --daemon: serve listings
+    const char *client_socket = NULL;   // --socket: ask a daemon first
 
     // Parse options
-    while ((opt = getopt(argc, argv, "lxR")) != -1) {
+    while ((opt = getopt_long(argc, argv, "lxRUftSj:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'l':
                 display_mode = DISPLAY_LONG;
@@ -62,249 +586,3369 @@ int main(int argc, char *argv[]) {
             case 'R':
                 recursive_flag = 1;
                 break;
+            case 'U':
+                unsorted = 1;
+                break;
+            case 'f':
+                unsorted = 1;
+                show_all = 1;
+                break;
+            case 't':
+                sort_by = SORT_TIME;
+                break;
+            case 'S':
+                sort_by = SORT_SIZE;
+                break;
+            case 'j':
+                jobs = parse_count(argv[0], "-j", optarg, 1, INT_MAX);
+                break;
+            case OPT_DIRBUF:
+                dirbuf_size = parse_size(optarg);
+                if (dirbuf_size < 4096) dirbuf_size = 4096;
+                break;
+            case OPT_STATS:
+                show_stats = 1;
+                break;
+            case OPT_COLLATE:
+                collate = 1;
+                break;
+            case OPT_SORT_THREADS:
+                sort_threads = parse_count(argv[0], "--sort-threads", optarg, 0, INT_MAX);
+                break;
+            case OPT_PARALLEL_SORT_MIN:
+                parallel_sort_min = parse_count(argv[0], "--parallel-sort-min", optarg, 0, LONG_MAX);
+                break;
+            case OPT_HEAD:
+                head_limit = parse_count(argv[0], "--head", optarg, 0, LONG_MAX);
+                break;
+            case OPT_JSON:
+                display_mode = DISPLAY_JSON;
+                break;
+            case OPT_NDJSON:
+                display_mode = DISPLAY_NDJSON;
+                break;
+            case OPT_BUILD_INDEX:
+                index_out = optarg;
+                break;
+            case OPT_FROM_INDEX:
+                index_in = optarg;
+                break;
+            case OPT_DAEMON:
+                daemon_socket = optarg;
+                break;
+            case OPT_SOCKET:
+                client_socket = optarg;
+                break;
+            case OPT_URING:
+                use_uring = 1;
+                break;
+            case OPT_DONT_SYNC:
+#ifdef __linux__
+                stat_sync = AT_STATX_DONT_SYNC;
+#endif
+                break;
+            case OPT_STAT_THREADS:
+                stat_threads = parse_count(argv[0], "--stat-threads", optarg, 0, INT_MAX);
+                break;
+            case OPT_MAX_DEPTH:
+                max_depth = parse_count(argv[0], "--max-depth", optarg, 0, INT_MAX);
+                break;
+            case OPT_PRUNE:
+                prune_patterns = realloc(prune_patterns, (nprune + 1) * sizeof(*prune_patterns));
+                prune_patterns[nprune++] = optarg;
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-l | -x | -R] [directory]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-l | -x | --json | --ndjson] [-R] [-U | -f | -t | -S] [--head n] [-j jobs] [--dirbuf bytes] [--stats | --profile] [--uring] [--dont-sync]\n"
+                        "       [--max-depth n] [--prune pattern]\n"
+                        "       [--collate] [--sort-threads n] [--parallel-sort-min entries] [--stat-threads n]\n"
+                        "       [--build-index file | --from-index file] [--daemon socket | --socket socket]\n"
+                        "       [directory]\n",
+                        argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
     const char *dir = (optind < argc) ? argv[optind] : ".";
+    int status = 0;
 
-    if (display_mode == DISPLAY_LONG && !recursive_flag) {
-        display_long(dir);
-        return 0;
-    }
+    prof_run_start = prof_start();
+    init_colors();
+    if (index_out)
+        return build_index(index_out, dir) == -1 ? 1 : 0;
+    if (daemon_socket)
+        return run_daemon(daemon_socket);
+    // An unreadable index only costs speed: list the tree directly.
+    if (index_in)
+        active_index = open_index(index_in);
+
+    ob_init(&stdout_buf, STDOUT_FILENO);
+    if (collate)
+        setlocale(LC_COLLATE, "");
+    tzset();
+    now_time = time(NULL);
+    if (display_mode == DISPLAY_JSON)
+        ob_write(&stdout_buf, "[\n", 2);
 
-    if (recursive_flag) {
+    // -j already spreads the stats over its workers.
+    if (recursive_flag && jobs > 1 && stat_threads == 0)
+        stat_threads = 1;
+
+    if (recursive_flag && jobs > 1) {
+        do_ls_parallel(dir, display_mode, jobs);
+    } else if (recursive_flag) {
         do_ls(dir, display_mode);
+    } else if (client_socket && daemon_query(client_socket, dir, display_mode) == 0) {
+        // The daemon's output is in stdout_buf.
     } else {
-        char **files = NULL;
-        int count = 0, maxlen = 0;
-        if (gather_filenames(dir, &files, &count, &maxlen) == -1)
-            return 1;
+        struct dir_listing list;
+        int fd = open_dir_at(AT_FDCWD, dir);
+        if (fd == -1) {
+            status = 1;
+        } else {
+            if (render_directory(&stdout_buf, fd, dir, display_mode, &list) == -1)
+                status = 1;
+            else
+                free_listing(&list);
+            close(fd);
+        }
+    }
 
-        qsort(files, count, sizeof(char *), cmp_str);
+    if (display_mode == DISPLAY_JSON)
+        ob_puts(&stdout_buf, json_records ? "\n]\n" : "]\n");
+    ob_flush(&stdout_buf);
+    ob_free(&stdout_buf);
+    if (show_stats)
+        print_stats();
+    return status;
+}
 
-        if (display_mode == DISPLAY_HORIZONTAL)
-            display_horizontal(files, count, maxlen, dir);
-        else
-            display_default(files, count, maxlen, dir);
+// ================== Directory Handles ==================
+// Directories are opened relative to their parent's descriptor and
+// entries are stat'ed relative to their directory's descriptor, so the
+// kernel never re-walks the full path and depth is not limited by a
+// fixed path buffer. The command-line directory (parent_fd == AT_FDCWD)
+// may be a symlink; anything below it must be a real directory.
+int open_dir_at(int parent_fd, const char *name) {
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (parent_fd != AT_FDCWD) flags |= O_NOFOLLOW;
+
+    uint64_t t = prof_start();
+    int fd = openat(parent_fd, name, flags);
+    prof_end(PROF_READ, t);
+    prof.opens++;
+    if (fd == -1)
+        perror("opendir");
+    return fd;
+}
+
+// "dir/name" in a freshly allocated string; only used for display.
+char *join_path(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char *path = malloc(dlen + nlen + 2);
+    memcpy(path, dir, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, nlen + 1);
+    return path;
+}
+
+// ================== Directory Reader ==================
+#ifdef __linux__
+int dir_reader_open(struct dir_reader *r, int dirfd) {
+    if (dirbuf_alloc != dirbuf_size) {
+        free(dirbuf);
+        dirbuf = malloc(dirbuf_size);
+        dirbuf_alloc = dirbuf_size;
+    }
+    r->fd = dirfd;
+    r->buf = dirbuf;
+    r->pos = r->len = 0;
+    return 0;
+}
 
-        for (int i = 0; i < count; i++) free(files[i]);
-        free(files);
+// Returns 1 and fills rec, 0 at the end of the directory, -1 on error.
+int dir_reader_next(struct dir_reader *r, struct dir_record *rec) {
+    if (r->pos >= r->len) {
+        uint64_t t = prof_start();
+        long n = syscall(SYS_getdents64, r->fd, r->buf, dirbuf_alloc);
+        prof_end(PROF_READ, t);
+        prof.getdents++;
+        if (n <= 0) {
+            if (n == -1) perror("getdents64");
+            return n == 0 ? 0 : -1;
+        }
+        r->pos = 0;
+        r->len = n;
     }
 
+    struct linux_dirent64 *d = (struct linux_dirent64 *)(r->buf + r->pos);
+    r->pos += d->d_reclen;
+
+    // d_reclen is offsetof(d_name) + len + 1 rounded up to 8, so the
+    // terminating NUL is somewhere in the record's last 8 bytes.
+    int room = d->d_reclen - offsetof(struct linux_dirent64, d_name);
+    int skip = room > 8 ? room - 8 : 0;
+    rec->name = d->d_name;
+    rec->len = skip + strnlen(d->d_name + skip, room - skip);
+    rec->d_type = d->d_type;
+    rec->ino = d->d_ino;
+    return 1;
+}
+
+void dir_reader_close(struct dir_reader *r) {
+    r->buf = NULL;
+}
+
+// Nonzero while records from the last getdents64 call remain.
+int dir_reader_pending(struct dir_reader *r) {
+    return r->pos < r->len;
+}
+
+// Called by threads that are about to exit.
+void dir_reader_free_buffer(void) {
+    free(dirbuf);
+    dirbuf = NULL;
+    dirbuf_alloc = 0;
+}
+#else
+int dir_reader_open(struct dir_reader *r, int dirfd) {
+    // fdopendir takes ownership of its descriptor; the caller keeps
+    // dirfd for fstatat/openat, so hand readdir a duplicate.
+    int fd = dup(dirfd);
+    r->dp = fd == -1 ? NULL : fdopendir(fd);
+    if (!r->dp) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
     return 0;
 }
 
+int dir_reader_next(struct dir_reader *r, struct dir_record *rec) {
+    uint64_t t = prof_start();
+    struct dirent *entry = readdir(r->dp);
+    prof_end(PROF_READ, t);
+    prof.getdents++;
+    if (!entry) return 0;
+    rec->name = entry->d_name;
+    rec->len = strlen(entry->d_name);
+    rec->d_type = entry->d_type;
+    rec->ino = entry->d_ino;
+    return 1;
+}
+
+void dir_reader_close(struct dir_reader *r) {
+    closedir(r->dp);
+}
+
+// readdir batches internally; never report a batch boundary.
+int dir_reader_pending(struct dir_reader *r) {
+    (void)r;
+    return 1;
+}
+
+void dir_reader_free_buffer(void) {
+}
+#endif
+
+// ================== Name Arena ==================
+// Copy name (with its NUL) to the end of the arena and return its
+// offset. The arena may move while it grows, so entries record offsets
+// and get real pointers once the directory has been read completely.
+size_t arena_add_name(struct dir_listing *list, const char *name, int len) {
+    if (list->names_used + len + 1 > list->names_cap) {
+        size_t cap = list->names_cap ? list->names_cap * 2 : 4096;
+        while (cap < list->names_used + len + 1) cap *= 2;
+        list->names = realloc(list->names, cap);
+        list->names_cap = cap;
+    }
+    size_t off = list->names_used;
+    memcpy(list->names + off, name, len + 1);
+    list->names_used += len + 1;
+    return off;
+}
+
+// Add a copy of f (and its name) to list.
+void listing_append(struct dir_listing *list, const struct file_entry *f) {
+    if (list->count >= list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->files = realloc(list->files, list->cap * sizeof(struct file_entry));
+    }
+    struct file_entry *copy = &list->files[list->count++];
+    *copy = *f;
+    copy->has_xfrm = 0;
+    copy->name_off = arena_add_name(list, f->name, f->len);
+}
+
+// Point the entries at their names (and sort keys) once the arena has
+// stopped growing.
+void listing_finish(struct dir_listing *list) {
+    for (int i = 0; i < list->count; i++) {
+        struct file_entry *f = &list->files[i];
+        f->name = list->names + f->name_off;
+        if (f->has_xfrm) {
+            f->key = list->names + f->key_off;
+        } else {
+            f->key = f->name;
+            f->key_len = f->len;
+        }
+    }
+}
+
+// --collate: store each name's strxfrm transform in the arena next to
+// the names. Sorting those keys bytewise gives strcoll order while
+// calling into the locale once per file instead of once per comparison.
+void collate_keys(struct dir_listing *list) {
+    for (int i = 0; i < list->count; i++) {
+        struct file_entry *f = &list->files[i];
+        const char *name = list->names + f->name_off;
+        size_t room = 4 * f->len + 16;
+
+        for (;;) {
+            if (list->names_used + room > list->names_cap) {
+                size_t cap = list->names_cap * 2;
+                while (cap < list->names_used + room) cap *= 2;
+                list->names = realloc(list->names, cap);
+                list->names_cap = cap;
+                name = list->names + f->name_off;
+            }
+            size_t n = strxfrm(list->names + list->names_used, name, room);
+            if (n < room) {
+                f->has_xfrm = 1;
+                f->key_off = list->names_used;
+                f->key_len = n;
+                list->names_used += n + 1;
+                break;
+            }
+            room = n + 1;
+        }
+    }
+    listing_finish(list);
+}
+
+// Turn a raw directory record into an entry whose name still points
+// into the reader's buffer.
+void entry_from_record(struct file_entry *f, const struct dir_record *rec) {
+    memset(f, 0, sizeof(*f));
+    f->name = (char *)rec->name;
+    f->len = rec->len;
+    f->d_type = rec->d_type;
+    f->mode = dtype_to_mode(rec->d_type);
+    f->ino = rec->ino;
+}
+
+// Dot files are listed only with -f.
+int is_listed(const char *name) {
+    return show_all || name[0] != '.';
+}
+
 // ================== Gather Filenames ==================
-int gather_filenames(const char *dir, char ***filenames, int *count, int *maxlen) {
-    DIR *dp = opendir(dir);
-    if (!dp) {
+int gather_filenames(int dirfd, struct dir_listing *list) {
+    memset(list, 0, sizeof(*list));
+
+    struct dir_reader reader;
+    if (dir_reader_open(&reader, dirfd) == -1) {
         perror("opendir");
         return -1;
     }
 
-    struct dirent *entry;
-    int size = 0;
-    char **files = NULL;
-    *maxlen = 0;
-    *count = 0;
+    struct dir_record rec;
+    struct file_entry f;
 
-    while ((entry = readdir(dp)) != NULL) {
-        if (entry->d_name[0] == '.') continue; // skip hidden files
-        if (*count >= size) {
-            size = size ? size * 2 : 16;
-            files = realloc(files, size * sizeof(char *));
-        }
-        files[*count] = strdup(entry->d_name);
-        int len = strlen(entry->d_name);
-        if (len > *maxlen) *maxlen = len;
-        (*count)++;
+    while (dir_reader_next(&reader, &rec) == 1) {
+        if (!is_listed(rec.name)) continue;
+        entry_from_record(&f, &rec);
+        listing_append(list, &f);
     }
 
-    closedir(dp);
-    *filenames = files;
+    dir_reader_close(&reader);
+    listing_finish(list);
+    prof.entries += list->count;
     return 0;
 }
 
+void free_listing(struct dir_listing *list) {
+    free(list->files);
+    free(list->names);
+    list->files = NULL;
+    list->names = NULL;
+    list->count = 0;
+}
+
 // ================== Get Terminal Width ==================
 int get_terminal_width() {
+    if (term_width > 0)
+        return term_width;
+
     struct winsize w;
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1)
         return 80; // fallback
     return w.ws_col;
 }
 
-// ================== Get File Mode ==================
-int get_file_mode(const char *dir, const char *filename, mode_t *mode) {
-    char path[1024];
-    snprintf(path, sizeof(path), "%s/%s", dir, filename);
+// ================== Output Buffer ==================
+void ob_init(struct outbuf *ob, int fd) {
+    ob->fd = fd;
+    ob->len = 0;
+    ob->cap = fd == -1 ? 4096 : OUTBUF_SIZE;
+    ob->buf = malloc(ob->cap);
+}
 
-    struct stat st;
-    if (lstat(path, &st) == -1) {
-        perror("lstat");
-        return -1;
+void ob_free(struct outbuf *ob) {
+    free(ob->buf);
+    ob->buf = NULL;
+    ob->len = ob->cap = 0;
+}
+
+// Write iov out completely, retrying on EINTR and short writes.
+void write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        uint64_t t = prof_start();
+        ssize_t n = writev(fd, iov, iovcnt);
+        prof_end(PROF_WRITE, t);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        prof.bytes += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
+}
 
-    *mode = st.st_mode;
-    return 0;
+void ob_flush(struct outbuf *ob) {
+    if (ob->fd == -1 || ob->len == 0) return;
+    struct iovec iov = { ob->buf, ob->len };
+    write_all(ob->fd, &iov, 1);
+    ob->len = 0;
 }
 
-// ================== Print Colored File ==================
-void print_colored_file(const char *dir, const char *filename) {
-    mode_t mode;
-    if (get_file_mode(dir, filename, &mode) == -1) {
-        printf("%s", filename);
+// Make room for n more bytes: flush a descriptor buffer, grow a memory one.
+void ob_reserve(struct outbuf *ob, size_t n) {
+    if (ob->len + n <= ob->cap) return;
+    if (ob->fd != -1) {
+        ob_flush(ob);
+        if (n <= ob->cap) return;
+    }
+    while (ob->cap < ob->len + n) ob->cap *= 2;
+    ob->buf = realloc(ob->buf, ob->cap);
+}
+
+void ob_write(struct outbuf *ob, const char *s, size_t n) {
+    // Large chunks headed for a descriptor go out together with whatever
+    // is pending in a single writev instead of being copied first.
+    if (ob->fd != -1 && ob->len + n > ob->cap && n >= ob->cap / 2) {
+        struct iovec iov[2] = { { ob->buf, ob->len }, { (void *)s, n } };
+        write_all(ob->fd, iov, 2);
+        ob->len = 0;
         return;
     }
+    ob_reserve(ob, n);
+    memcpy(ob->buf + ob->len, s, n);
+    ob->len += n;
+}
 
-    const char *color = COLOR_RESET;
+void ob_puts(struct outbuf *ob, const char *s) {
+    ob_write(ob, s, strlen(s));
+}
 
-    if (S_ISDIR(mode))
-        color = COLOR_BLUE;
-    else if (S_ISLNK(mode))
-        color = COLOR_PINK;
-    else if (mode & S_IXUSR || mode & S_IXGRP || mode & S_IXOTH)
-        color = COLOR_GREEN;
-    else if (S_ISCHR(mode) || S_ISBLK(mode) || S_ISFIFO(mode) || S_ISSOCK(mode))
-        color = COLOR_REVERSE;
-    else if (strstr(filename, ".tar") || strstr(filename, ".gz") || strstr(filename, ".zip"))
-        color = COLOR_RED;
+void ob_putc(struct outbuf *ob, char c) {
+    if (ob->len == ob->cap) ob_reserve(ob, 1);
+    ob->buf[ob->len++] = c;
+}
 
-    printf("%s%s%s", color, filename, COLOR_RESET);
+// n spaces
+void ob_pad(struct outbuf *ob, int n) {
+    if (n <= 0) return;
+    ob_reserve(ob, n);
+    memset(ob->buf + ob->len, ' ', n);
+    ob->len += n;
 }
 
-// ================== Default Display (Down-Then-Across) ==================
-void display_default(char **files, int count, int maxlen, const char *dir) {
-    int width = get_terminal_width();
-    int spacing = 2;
-    int cols = width / (maxlen + spacing);
-    if (cols < 1) cols = 1;
-    int rows = (count + cols - 1) / cols;
-
-    for (int r = 0; r < rows; r++) {
-        for (int c = 0; c < cols; c++) {
-            int i = c * rows + r;
-            if (i < count) {
-                print_colored_file(dir, files[i]);
-                int pad = maxlen - (int)strlen(files[i]) + spacing;
-                for (int p = 0; p < pad; p++) printf(" ");
-            }
-        }
-        printf("\n");
+void ob_printf(struct outbuf *ob, const char *fmt, ...) {
+    va_list ap;
+    size_t room = ob->cap - ob->len;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(ob->buf + ob->len, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n >= room) {
+        ob_reserve(ob, n + 1);
+        va_start(ap, fmt);
+        vsnprintf(ob->buf + ob->len, n + 1, fmt, ap);
+        va_end(ap);
     }
+    ob->len += n;
 }
 
-// ================== Horizontal Display (-x) ==================
-void display_horizontal(char **files, int count, int maxlen, const char *dir) {
-    int width = get_terminal_width();
-    int spacing = 2;
-    int col_width = maxlen + spacing;
-    int curr_width = 0;
+// "drwxr-xr-x" as shown by -l, with a trailing 't' for the sticky bit.
+void ob_mode(struct outbuf *ob, mode_t mode) {
+    static const char rwx[] = "rwxrwxrwx";
+    char s[11];
+    int n = 0;
 
-    for (int i = 0; i < count; i++) {
-        if (curr_width + col_width > width) {
-            printf("\n");
-            curr_width = 0;
+    s[n++] = S_ISDIR(mode)  ? 'd' :
+             S_ISLNK(mode)  ? 'l' :
+             S_ISCHR(mode)  ? 'c' :
+             S_ISBLK(mode)  ? 'b' :
+             S_ISFIFO(mode) ? 'p' :
+             S_ISSOCK(mode) ? 's' : '-';
+    for (int i = 0; i < 9; i++)
+        s[n++] = (mode & (0400 >> i)) ? rwx[i] : '-';
+    if (mode & S_ISVTX) s[n++] = 't';
+    ob_write(ob, s, n);
+}
+
+// Like "%*ld": value right-aligned in width columns.
+void ob_num(struct outbuf *ob, long value, int width) {
+    char tmp[24];
+    int n = 0;
+    unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+
+    do {
+        tmp[sizeof(tmp) - 1 - n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (value < 0) tmp[sizeof(tmp) - 1 - n++] = '-';
+    ob_pad(ob, width - n);
+    ob_write(ob, tmp + sizeof(tmp) - n, n);
+}
+
+// Like "%-*s": s left-aligned in width columns.
+void ob_str_left(struct outbuf *ob, const char *s, int width) {
+    size_t n = strlen(s);
+    ob_write(ob, s, n);
+    ob_pad(ob, width - (int)n);
+}
+
+// ================== Timestamp Formatting ==================
+// Write the 12-column -l timestamp like GNU ls: "Mmm dd HH:MM" for the
+// last six months, "Mmm dd  YYYY" for older or future times.
+void format_mtime(char buf[12], time_t t) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct time_cache *c = &mtime_cache;
+    int secs;
+
+    if (t >= c->day_start && t < c->day_end) {
+        secs = t - c->day_start;
+    } else {
+        struct tm tm, first, end;
+        localtime_r(&t, &tm);
+        secs = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+
+        memcpy(c->day, months + 3 * tm.tm_mon, 3);
+        c->day[3] = ' ';
+        c->day[4] = tm.tm_mday >= 10 ? '0' + tm.tm_mday / 10 : ' ';
+        c->day[5] = '0' + tm.tm_mday % 10;
+        c->year = tm.tm_year + 1900;
+
+        // Only reuse the day if t - secs really is its midnight and the
+        // UTC offset is the same at both ends. On a DST switch day the
+        // first check fails whenever t is after the switch, the second
+        // whenever t is before it.
+        time_t start = t - secs, last = start + 86399;
+        localtime_r(&start, &first);
+        localtime_r(&last, &end);
+        if (first.tm_hour == 0 && first.tm_min == 0 && first.tm_sec == 0 &&
+            first.tm_mday == tm.tm_mday && first.tm_gmtoff == tm.tm_gmtoff &&
+            end.tm_gmtoff == tm.tm_gmtoff && end.tm_mday == tm.tm_mday) {
+            c->day_start = start;
+            c->day_end = start + 86400;
+        } else {
+            c->day_start = c->day_end = 0;
         }
+    }
 
-        print_colored_file(dir, files[i]);
-        int pad = col_width - (int)strlen(files[i]);
-        for (int p = 0; p < pad; p++) printf(" ");
-        curr_width += col_width;
+    memcpy(buf, c->day, 6);
+    buf[6] = ' ';
+    if (t > now_time - SIX_MONTHS && t <= now_time) {
+        int hour = secs / 3600, min = secs / 60 % 60;
+        buf[7] = '0' + hour / 10;
+        buf[8] = '0' + hour % 10;
+        buf[9] = ':';
+        buf[10] = '0' + min / 10;
+        buf[11] = '0' + min % 10;
+    } else {
+        char year[12];
+        snprintf(year, sizeof(year), "%5d", c->year);
+        memcpy(buf + 7, year, 5);
+        buf[7] = ' ';
     }
-    printf("\n");
 }
 
-// ================== Long Listing (-l) ==================
-void display_long(const char *dir) {
-    DIR *dp = opendir(dir);
-    if (!dp) {
-        perror("opendir");
-        return;
+// ================== User/Group Name Cache ==================
+struct id_cache_slot *id_cache_find(struct id_cache *c, unsigned int id) {
+    size_t mask = c->cap - 1;
+    size_t i = (id * 2654435761u) & mask;
+    while (c->slots[i].used && c->slots[i].id != id)
+        i = (i + 1) & mask;
+    return &c->slots[i];
+}
+
+void id_cache_grow(struct id_cache *c) {
+    struct id_cache old = *c;
+    c->cap = old.cap ? old.cap * 2 : 64;
+    c->slots = calloc(c->cap, sizeof(*c->slots));
+    for (size_t i = 0; i < old.cap; i++)
+        if (old.slots[i].used)
+            *id_cache_find(c, old.slots[i].id) = old.slots[i];
+    free(old.slots);
+}
+
+// Look id up in c, resolving it with lookup() on a miss.
+// Returns NULL for ids without a name.
+const char *id_cache_get(struct id_cache *c, unsigned int id,
+                         const char *(*lookup)(unsigned int)) {
+    pthread_mutex_lock(&id_cache_lock);
+    if (c->count * 2 >= c->cap)
+        id_cache_grow(c);
+
+    struct id_cache_slot *slot = id_cache_find(c, id);
+    if (slot->used) {
+        c->hits++;
+    } else {
+        uint64_t t = prof_start();
+        const char *name = lookup(id);
+        prof_end(PROF_NSS, t);
+        c->misses++;
+        c->count++;
+        slot->used = 1;
+        slot->id = id;
+        slot->name = name ? strdup(name) : NULL;
     }
+    const char *name = slot->name;
+    pthread_mutex_unlock(&id_cache_lock);
+    return name;
+}
 
-    struct dirent *entry;
-    struct stat st;
-    char path[1024];
-
-    while ((entry = readdir(dp)) != NULL) {
-        if (entry->d_name[0] == '.') continue;
-
-        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
-        if (lstat(path, &st) == -1) continue;
-
-        // File type
-        printf((S_ISDIR(st.st_mode)) ? "d" :
-               (S_ISLNK(st.st_mode)) ? "l" :
-               (S_ISCHR(st.st_mode)) ? "c" :
-               (S_ISBLK(st.st_mode)) ? "b" :
-               (S_ISFIFO(st.st_mode)) ? "p" :
-               (S_ISSOCK(st.st_mode)) ? "s" : "-");
-
-        // Permissions
-        printf("%c", (st.st_mode & S_IRUSR) ? 'r' : '-');
-        printf("%c", (st.st_mode & S_IWUSR) ? 'w' : '-');
-        printf("%c", (st.st_mode & S_IXUSR) ? 'x' : '-');
-        printf("%c", (st.st_mode & S_IRGRP) ? 'r' : '-');
-        printf("%c", (st.st_mode & S_IWGRP) ? 'w' : '-');
-        printf("%c", (st.st_mode & S_IXGRP) ? 'x' : '-');
-        printf("%c", (st.st_mode & S_IROTH) ? 'r' : '-');
-        printf("%c", (st.st_mode & S_IWOTH) ? 'w' : '-');
-        printf("%c", (st.st_mode & S_IXOTH) ? 'x' : '-');
-
-        // Sticky bit
-        if (st.st_mode & S_ISVTX) printf("t");
-
-        struct passwd *pw = getpwuid(st.st_uid);
-        struct group *gr = getgrgid(st.st_gid);
-        printf(" %3ld %-8s %-8s %8ld %.12s %s\n",
-               st.st_nlink,
-               pw ? pw->pw_name : "?",
-               gr ? gr->gr_name : "?",
-               st.st_size,
-               ctime(&st.st_mtime) + 4,
-               entry->d_name);
-    }
-
-    closedir(dp);
+const char *lookup_user(unsigned int id) {
+    struct passwd *pw = getpwuid(id);
+    return pw ? pw->pw_name : NULL;
 }
 
-// ================== Recursive Listing (-R) ==================
-void do_ls(const char *dir, int display_mode) {
-    char **files = NULL;
-    int count = 0, maxlen = 0;
+const char *lookup_group(unsigned int id) {
+    struct group *gr = getgrgid(id);
+    return gr ? gr->gr_name : NULL;
+}
 
-    printf("%s:\n", dir);
+// "?" for ids without a name, like the old getpwuid code.
+const char *user_name(uid_t uid) {
+    const char *name = id_cache_get(&user_cache, uid, lookup_user);
+    return name ? name : "?";
+}
 
-    if (gather_filenames(dir, &files, &count, &maxlen) == -1)
-        return;
+const char *group_name(gid_t gid) {
+    const char *name = id_cache_get(&group_cache, gid, lookup_group);
+    return name ? name : "?";
+}
 
-    qsort(files, count, sizeof(char *), cmp_str);
+// ================== Statistics (--stats) ==================
+uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    if (display_mode == DISPLAY_HORIZONTAL)
-        display_horizontal(files, count, maxlen, dir);
-    else if (display_mode == DISPLAY_DEFAULT)
-        display_default(files, count, maxlen, dir);
-    else
-        display_long(dir);
+uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    for (int i = 0; i < count; i++) {
-        char path[1024];
-        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+uint64_t prof_start(void) {
+    return show_stats ? clock_ns() : 0;
+}
+
+// Charge the time since start to phase; stat calls also go into the
+// latency histogram.
+void prof_end(int phase, uint64_t start) {
+    if (!show_stats) return;
+    uint64_t ns = prof_start() - start;
+    prof.ns[phase] += ns;
+    prof.calls[phase]++;
+
+    if (phase == PROF_STAT)
+        prof_stat_latency(ns);
+}
+
+// Add one stat that took ns to the latency histogram.
+void prof_stat_latency(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int b = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    prof.stat_hist[b < STAT_BUCKETS ? b : STAT_BUCKETS - 1]++;
+}
+
+// Fold the calling thread's counters into prof_total.
+void prof_merge(void) {
+    if (!show_stats) return;
+    pthread_mutex_lock(&prof_lock);
+    for (int i = 0; i < PROF_PHASES; i++) {
+        prof_total.ns[i] += prof.ns[i];
+        prof_total.calls[i] += prof.calls[i];
+    }
+    prof_total.opens += prof.opens;
+    prof_total.getdents += prof.getdents;
+    prof_total.dirs += prof.dirs;
+    prof_total.entries += prof.entries;
+    prof_total.uring_stats += prof.uring_stats;
+    prof_total.uring_enters += prof.uring_enters;
+    prof_total.fstats += prof.fstats;
+    prof_total.index_hits += prof.index_hits;
+    prof_total.index_misses += prof.index_misses;
+    prof_total.bytes += prof.bytes;
+    prof_total.pooled_dirs += prof.pooled_dirs;
+    if (prof.pool_threads > prof_total.pool_threads)
+        prof_total.pool_threads = prof.pool_threads;
+    for (int i = 0; i < STAT_BUCKETS; i++)
+        prof_total.stat_hist[i] += prof.stat_hist[i];
+    prof_total.threads++;
+    pthread_mutex_unlock(&prof_lock);
+    memset(&prof, 0, sizeof(prof));
+}
+
+void print_stats(void) {
+    static const char *phase_names[PROF_PHASES] = {
+        "read", "stat", "nss", "sort", "layout", "format", "write"
+    };
+    double wall = (prof_start() - prof_run_start) / 1e6;
+    struct profile *p = &prof_total;
+
+    prof_merge();
+    fprintf(stderr, "%-8s %12s %10s\n", "phase", "ms", "calls");
+    for (int i = 0; i < PROF_PHASES; i++)
+        fprintf(stderr, "%-8s %12.3f %10ld\n", phase_names[i], p->ns[i] / 1e6, p->calls[i]);
+    fprintf(stderr, "%-8s %12.3f\n", "wall", wall);
+    if (p->threads > 1)
+        fprintf(stderr, "(phase times are summed over %d threads)\n", p->threads);
+
+    fprintf(stderr, "directories: %ld, entries: %ld, bytes written: %lld\n",
+            p->dirs, p->entries, p->bytes);
+    long stats = p->calls[PROF_STAT] - p->uring_stats;
+    fprintf(stderr, "syscalls: %ld (openat %ld, getdents64 %ld, %s %ld, fstat %ld, writev %ld",
+            p->opens + p->getdents + stats + p->fstats + p->uring_enters + p->calls[PROF_WRITE],
+            p->opens, p->getdents, statx_missing ? "fstatat" : "statx", stats,
+            p->fstats, p->calls[PROF_WRITE]);
+    if (p->uring_enters)
+        fprintf(stderr, ", io_uring_enter %ld for %ld statx", p->uring_enters, p->uring_stats);
+    fprintf(stderr, ")\n");
+    if (active_index)
+        fprintf(stderr, "index: %ld directories served, %ld rescanned\n",
+                p->index_hits, p->index_misses);
+    if (p->pooled_dirs)
+        fprintf(stderr, "stat pool: %ld directories, up to %d threads\n",
+                p->pooled_dirs, p->pool_threads);
+
+    long timed = 0;
+    for (int b = 0; b < STAT_BUCKETS; b++)
+        timed += p->stat_hist[b];
+    if (timed)
+        fprintf(stderr, "stat latency:\n");
+    for (int b = 0; b < STAT_BUCKETS; b++) {
+        char label[32];
+        long lo = b == 0 ? 0 : 1L << (b - 1);
+        if (p->stat_hist[b] == 0) continue;
+        if (b == 0)
+            snprintf(label, sizeof(label), "< 1us");
+        else if (b == STAT_BUCKETS - 1)
+            snprintf(label, sizeof(label), ">= %ldus", lo);
+        else
+            snprintf(label, sizeof(label), "%ld-%ldus", lo, 2 * lo);
+        fprintf(stderr, "  %-16s %10ld\n", label, p->stat_hist[b]);
+    }
+
+    fprintf(stderr, "uid cache: %ld hits, %ld misses\n",
+            user_cache.hits, user_cache.misses);
+    fprintf(stderr, "gid cache: %ld hits, %ld misses\n",
+            group_cache.hits, group_cache.misses);
+}
+
+// ================== Stat Entries ==================
+// On Linux every stat is a statx that asks only for the fields the
+// listing will print: file type and permission bits for colors, the
+// full -l set otherwise. Local filesystems fill everything anyway, but
+// network filesystems can skip revalidating what was not asked for.
+#ifdef __linux__
+#define STATX_LONG (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | \
+                    STATX_INO | STATX_SIZE | STATX_MTIME)
+
+unsigned int stat_mask(int need) {
+    return need == STAT_FULL ? STATX_LONG : STATX_TYPE | STATX_MODE;
+}
 
-        struct stat st;
-        if (lstat(path, &st) == -1) continue;
+void entry_from_statx(struct file_entry *f, const struct statx *sx) {
+    f->have_stat = (sx->stx_mask & STATX_LONG) == STATX_LONG;
+    f->mode = sx->stx_mode;
+    f->size = sx->stx_size;
+    f->mtime = sx->stx_mtime.tv_sec;
+    f->mtime_nsec = sx->stx_mtime.tv_nsec;
+    f->uid = sx->stx_uid;
+    f->gid = sx->stx_gid;
+    f->nlink = sx->stx_nlink;
+    f->ino = sx->stx_ino;
+    f->dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+}
+#endif
 
-        if (S_ISDIR(st.st_mode)) {
-            if (strcmp(files[i], ".") != 0 && strcmp(files[i], "..") != 0) {
-                printf("\n");
-                do_ls(path, display_mode);
+int lstat_entry(int dirfd, struct file_entry *file, int need) {
+    uint64_t t = prof_start();
+#if defined(__linux__) && defined(SYS_statx)
+    if (!statx_missing) {
+        struct statx sx;
+        int r = syscall(SYS_statx, dirfd, file->name, AT_SYMLINK_NOFOLLOW | stat_sync,
+                        stat_mask(need), &sx);
+        if (r == 0 || errno != ENOSYS) {
+            prof_end(PROF_STAT, t);
+            if (r == -1) {
+                perror("lstat");
+                return -1;
             }
+            entry_from_statx(file, &sx);
+            return 0;
         }
+        statx_missing = 1;
+    }
+#else
+    (void)need;
+#endif
+
+    struct stat st;
+    int r = fstatat(dirfd, file->name, &st, AT_SYMLINK_NOFOLLOW);
+    prof_end(PROF_STAT, t);
+    if (r == -1) {
+        perror("lstat");
+        return -1;
+    }
+
+    file->have_stat = 1;
+    file->mode = st.st_mode;
+    file->size = st.st_size;
+    file->mtime = st.st_mtim.tv_sec;
+    file->mtime_nsec = st.st_mtim.tv_nsec;
+    file->uid = st.st_uid;
+    file->gid = st.st_gid;
+    file->nlink = st.st_nlink;
+    file->ino = st.st_ino;
+    file->dev = st.st_dev;
+    return 0;
+}
+
+// With ln=target a link is colored like GNU ls colors it: as if it had
+// the type and mode of what it points to (suffixes still match the
+// link's own name). Dangling links stay uncolored.
+void resolve_link_color(int dirfd, struct file_entry *f) {
+    struct stat st;
+    struct file_entry t;
+
+    f->link_color = NULL;
+    if (fstatat(dirfd, f->name, &st, 0) == -1)
+        return;
+    t = *f;
+    t.mode = st.st_mode;
+    f->link_color = color_for(&t);
+}
+
+int stat_entry(int dirfd, struct file_entry *file, int need) {
+    if (lstat_entry(dirfd, file, need) == -1)
+        return -1;
+    if (colors.link_target && S_ISLNK(file->mode))
+        resolve_link_color(dirfd, file);
+    return 0;
+}
+
+// Fill in the records of one directory with as little lstat traffic as
+// the display mode allows. Colors only need permission bits for regular
+// files (executable check) and for entries whose d_type was DT_UNKNOWN,
+// plus directories when LS_COLORS colors sticky/other-writable ones and
+// links with ln=target.
+// -t and -S need size/mtime; they come from the same single stat pass.
+int stat_need(int display_mode) {
+    if (display_mode == DISPLAY_LONG || is_json(display_mode) || sort_by != SORT_NAME)
+        return STAT_FULL;
+    return STAT_COLOR;
+}
+
+int stat_wanted(const struct file_entry *f, int need) {
+    return need == STAT_FULL || f->mode == 0 || S_ISREG(f->mode) ||
+           (S_ISDIR(f->mode) && colors.dir_modes) ||
+           (S_ISLNK(f->mode) && colors.link_target);
+}
+
+void stat_pool_drain(struct stat_pool *p) {
+    for (;;) {
+        int start = __atomic_fetch_add(&p->next, STAT_POOL_CHUNK, __ATOMIC_RELAXED);
+        if (start >= p->count) return;
+        int end = start + STAT_POOL_CHUNK < p->count ? start + STAT_POOL_CHUNK : p->count;
+        for (int i = start; i < end; i++)
+            if (stat_wanted(&p->files[i], p->need))
+                stat_entry(p->dirfd, &p->files[i], p->need);
     }
+}
+
+void *stat_pool_worker(void *arg) {
+    stat_pool_drain(arg);
+    prof_merge();
+    return NULL;
+}
 
-    for (int i = 0; i < count; i++) free(files[i]);
-    free(files);
+// The calling thread works alongside nthreads - 1 helpers.
+void stat_pool_run(int dirfd, struct file_entry *files, int count, int need, int nthreads) {
+    struct stat_pool p = { dirfd, need, count, files, 0 };
+    pthread_t threads[STAT_POOL_MAX];
+    int started = 0;
+    while (started < nthreads - 1 &&
+           pthread_create(&threads[started], NULL, stat_pool_worker, &p) == 0)
+        started++;
+    stat_pool_drain(&p);
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    prof.pooled_dirs++;
+    if (started + 1 > prof.pool_threads)
+        prof.pool_threads = started + 1;
+}
+
+// CPUs * (wall / cpu) threads, but at least 4 * STAT_POOL_CHUNK
+// records for each.
+int stat_pool_size(uint64_t wall, uint64_t cpu, int remaining) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    if (cpu == 0) cpu = 1;
+    uint64_t t = ncpu * wall / cpu;
+    if (t > STAT_POOL_MAX) t = STAT_POOL_MAX;
+    if (t > (uint64_t)remaining / (4 * STAT_POOL_CHUNK)) t = remaining / (4 * STAT_POOL_CHUNK);
+    return t < 1 ? 1 : (int)t;
+}
+
+void stat_entries(int dirfd, struct file_entry *files, int count, int need) {
+    if (use_uring && count > 1 && uring_stat_entries(dirfd, files, count, need) == 0)
+        return;
+
+    int i = 0;
+    if (stat_threads != 1 && count >= STAT_POOL_MIN) {
+        int nthreads = stat_threads;
+        if (nthreads == 0) {
+            int sampled = 0;
+            uint64_t wall = clock_ns(), cpu = thread_cpu_ns();
+            for (; i < count && sampled < STAT_POOL_SAMPLE; i++)
+                if (stat_wanted(&files[i], need)) {
+                    stat_entry(dirfd, &files[i], need);
+                    sampled++;
+                }
+            nthreads = sampled ? stat_pool_size(clock_ns() - wall, thread_cpu_ns() - cpu,
+                                                count - i) : 1;
+        }
+        if (nthreads > STAT_POOL_MAX) nthreads = STAT_POOL_MAX;
+        if (nthreads > 1) {
+            stat_pool_run(dirfd, files + i, count - i, need, nthreads);
+            return;
+        }
+    }
+
+    for (; i < count; i++)
+        if (stat_wanted(&files[i], need))
+            stat_entry(dirfd, &files[i], need);
+}
+
+// ================== Batched statx (io_uring) ==================
+// One IORING_OP_STATX request per entry, up to URING_DEPTH in flight;
+// completions are applied to their records in whatever order they
+// finish. On NFS and FUSE this overlaps the server round-trips that
+// fstatat pays one by one. On local disks the kernel hands statx to
+// its worker threads, which usually makes it slower than fstatat, so
+// the engine is opt-in. If the kernel refuses to set up a ring (too
+// old, or io_uring disabled) or its ring cannot do statx (5.1-5.5) the
+// plain loop is used from then on.
+#ifdef __linux__
+// Ask the ring whether it supports IORING_OP_STATX. The probe itself
+// arrived in 5.6 together with statx, so a kernel that does not know
+// the probe does not know statx either.
+int uring_has_statx(int fd) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    int ok = 0;
+    if (probe && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+        ok = probe->last_op >= IORING_OP_STATX &&
+             (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+int uring_setup(struct uring *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (fd < 0)
+        return -1;
+    if (!uring_has_statx(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = r->sq_map_len;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    r->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_map :
+                mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    char *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->entries = p.sq_entries < URING_DEPTH ? p.sq_entries : URING_DEPTH;
+    r->fd = fd;
+    r->ready = 1;
+    return 0;
+}
+
+// Called by threads that are about to exit.
+void uring_free(void) {
+    struct uring *r = &ring;
+    if (!r->ready) return;
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_len);
+    munmap(r->sq_map, r->sq_map_len);
+    close(r->fd);
+    memset(r, 0, sizeof(*r));
+}
+
+int uring_stat_entries(int dirfd, struct file_entry *files, int count, int need) {
+    struct uring *r = &ring;
+    if (uring_broken)
+        return -1;
+    if (!r->ready && uring_setup(r) == -1) {
+        uring_broken = 1;
+        return -1;
+    }
+
+    // Requests borrow a slot (statx buffer) and give it back on completion.
+    // With --stats a request's latency runs from its submission to its
+    // completion, so it includes time spent queued in the ring.
+    struct statx bufs[URING_DEPTH];
+    uint64_t queued_at[URING_DEPTH];
+    int slot_entry[URING_DEPTH], free_slots[URING_DEPTH];
+    int nfree = r->entries;
+    for (int s = 0; s < nfree; s++)
+        free_slots[s] = s;
+
+    uint64_t t = prof_start();
+    int next = 0, inflight = 0, unsubmitted = 0, done = 0;
+    for (;;) {
+        unsigned tail = *r->sq_tail;
+        while (nfree > 0) {
+            while (next < count && !stat_wanted(&files[next], need)) next++;
+            if (next == count) break;
+
+            int s = free_slots[--nfree];
+            unsigned at = tail & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[at];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dirfd;
+            sqe->addr = (uintptr_t)files[next].name;
+            sqe->len = stat_mask(need);
+            sqe->off = (uintptr_t)&bufs[s];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW | stat_sync;
+            sqe->user_data = s;
+            r->sq_array[at] = at;
+            slot_entry[s] = next++;
+            queued_at[s] = prof_start();
+            tail++;
+            unsubmitted++;
+            inflight++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        if (inflight == 0)
+            break;
+
+        long n = syscall(__NR_io_uring_enter, r->fd, unsubmitted, 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        prof.uring_enters++;
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            // Requests may still be running against bufs, so this
+            // thread cannot safely return; there is no recovering.
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        unsubmitted -= n;
+
+        unsigned head = *r->cq_head;
+        unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            int s = cqe->user_data;
+            if (show_stats)
+                prof_stat_latency(prof_start() - queued_at[s]);
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                perror("lstat");
+            } else {
+                struct file_entry *f = &files[slot_entry[s]];
+                entry_from_statx(f, &bufs[s]);
+                if (colors.link_target && S_ISLNK(f->mode))
+                    resolve_link_color(dirfd, f);
+            }
+            free_slots[nfree++] = s;
+            inflight--;
+            done++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (show_stats) {
+        prof.ns[PROF_STAT] += prof_start() - t;
+        prof.calls[PROF_STAT] += done;
+        prof.uring_stats += done;
+    }
+    return 0;
+}
+#else
+int uring_stat_entries(int dirfd, struct file_entry *files, int count, int need) {
+    (void)dirfd; (void)files; (void)count; (void)need;
+    return -1;
+}
+
+void uring_free(void) {
+}
+#endif
+
+// ================== Sort Engine ==================
+// Entries are sorted by their key (the name, or its strxfrm transform
+// with --collate) in strcmp order without calling a comparator per
+// comparison. Each entry becomes a compact (key, index) record where the
+// 64-bit key holds the next 8 bytes of the sort key, big-endian,
+// zero-padded past its end. Records are radix sorted on it; runs of
+// equal keys that go on past those 8 bytes are re-keyed 8 bytes further
+// in and sorted again (MSD by 64-bit digits). Small runs use insertion
+// sort with strcmp on the remaining bytes to break ties, and entries
+// with identical sort keys fall back to comparing names.
+#define SORT_SMALL 32
+
+struct sort_rec {
+    uint64_t key;
+    uint32_t idx;
+};
+
+uint64_t name_key(const struct file_entry *f, int depth) {
+    const unsigned char *s = (const unsigned char *)f->key + depth;
+    int n = f->key_len - depth;
+    uint64_t key = 0;
+
+    if (n > 8) n = 8;
+    for (int i = 0; i < 8; i++)
+        key = (key << 8) | (i < n ? s[i] : 0);
+    return key;
+}
+
+// A zero low byte means the sort key ended inside this digit, so two
+// records with that same digit have identical sort keys.
+int key_has_more(uint64_t key) {
+    return (key & 0xff) != 0;
+}
+
+int rec_less(const struct sort_rec *a, const struct sort_rec *b,
+             const struct file_entry *files, int depth) {
+    if (a->key != b->key) return a->key < b->key;
+    if (key_has_more(a->key)) {
+        int cmp = strcmp(files[a->idx].key + depth + 8, files[b->idx].key + depth + 8);
+        if (cmp != 0) return cmp < 0;
+    }
+    return strcmp(files[a->idx].name, files[b->idx].name) < 0;
+}
+
+void insertion_sort_recs(struct sort_rec *recs, size_t n,
+                         const struct file_entry *files, int depth) {
+    for (size_t i = 1; i < n; i++) {
+        struct sort_rec r = recs[i];
+        size_t j = i;
+        while (j > 0 && rec_less(&r, &recs[j - 1], files, depth)) {
+            recs[j] = recs[j - 1];
+            j--;
+        }
+        recs[j] = r;
+    }
+}
+
+// LSD radix sort on the 64-bit keys, one byte per pass. Passes where
+// every key has the same byte (common for shared name prefixes) are
+// skipped.
+void radix_sort_recs(struct sort_rec *recs, struct sort_rec *tmp, size_t n) {
+    size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < n; i++)
+        for (int b = 0; b < 8; b++)
+            counts[b][(recs[i].key >> (8 * b)) & 0xff]++;
+
+    struct sort_rec *src = recs, *dst = tmp;
+    for (int b = 0; b < 8; b++) {
+        size_t *c = counts[b];
+        if (c[(src[0].key >> (8 * b)) & 0xff] == n) continue;
+
+        size_t sum = 0;
+        for (int d = 0; d < 256; d++) {
+            size_t t = c[d];
+            c[d] = sum;
+            sum += t;
+        }
+        for (size_t i = 0; i < n; i++)
+            dst[c[(src[i].key >> (8 * b)) & 0xff]++] = src[i];
+
+        struct sort_rec *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != recs)
+        memcpy(recs, src, n * sizeof(*recs));
+}
+
+void msd_sort_recs(struct sort_rec *recs, struct sort_rec *tmp, size_t n,
+                   const struct file_entry *files, int depth) {
+    if (n < SORT_SMALL) {
+        insertion_sort_recs(recs, n, files, depth);
+        return;
+    }
+
+    radix_sort_recs(recs, tmp, n);
+
+    for (size_t i = 0; i < n; ) {
+        size_t j = i + 1;
+        while (j < n && recs[j].key == recs[i].key) j++;
+        if (j - i > 1 && key_has_more(recs[i].key)) {
+            for (size_t k = i; k < j; k++)
+                recs[k].key = name_key(&files[recs[k].idx], depth + 8);
+            msd_sort_recs(recs + i, tmp + i, j - i, files, depth + 8);
+        } else if (j - i > 1 && collate) {
+            // Different names can share a strxfrm key; order them by name.
+            insertion_sort_recs(recs + i, j - i, files, depth);
+        }
+        i = j;
+    }
+}
+
+// ---------- Parallel sort for very large directories ----------
+// Above parallel_sort_min entries the records are split into one chunk
+// per thread, each chunk is sorted with msd_sort_recs concurrently, and
+// the sorted chunks are combined with a k-way heap merge. The merge
+// uses the same total order, so the result matches the serial sort.
+struct sort_chunk {
+    struct sort_rec *recs, *tmp;
+    size_t n;
+    const struct file_entry *files;
+};
+
+void *sort_chunk_worker(void *arg) {
+    struct sort_chunk *c = arg;
+    msd_sort_recs(c->recs, c->tmp, c->n, c->files, 0);
+    // The MSD passes leave deeper digits behind; the merge compares
+    // from the start of the key again.
+    for (size_t i = 0; i < c->n; i++)
+        c->recs[i].key = name_key(&c->files[c->recs[i].idx], 0);
+    return NULL;
+}
+
+struct merge_head {
+    struct sort_rec *pos, *end;
+};
+
+void merge_sift_down(struct merge_head *heap, int k, int i, const struct file_entry *files) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < k && rec_less(heap[l].pos, heap[min].pos, files, 0)) min = l;
+        if (r < k && rec_less(heap[r].pos, heap[min].pos, files, 0)) min = r;
+        if (min == i) return;
+        struct merge_head t = heap[i];
+        heap[i] = heap[min];
+        heap[min] = t;
+        i = min;
+    }
+}
+
+void parallel_sort_recs(struct sort_rec *recs, struct sort_rec *out, size_t n,
+                        const struct file_entry *files, int nthreads) {
+    struct sort_chunk *chunks = malloc(nthreads * sizeof(*chunks));
+    pthread_t *threads = malloc(nthreads * sizeof(*threads));
+    size_t per = (n + nthreads - 1) / nthreads;
+
+    // out doubles as the scratch space of the chunk sorts. A chunk whose
+    // thread cannot be started is sorted right here.
+    char *started = malloc(nthreads);
+    for (int t = 0; t < nthreads; t++) {
+        size_t start = t * per;
+        chunks[t].recs = recs + start;
+        chunks[t].tmp = out + start;
+        chunks[t].n = start < n ? (n - start < per ? n - start : per) : 0;
+        chunks[t].files = files;
+        started[t] = pthread_create(&threads[t], NULL, sort_chunk_worker, &chunks[t]) == 0;
+        if (!started[t])
+            sort_chunk_worker(&chunks[t]);
+    }
+    for (int t = 0; t < nthreads; t++)
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    free(started);
+
+    struct merge_head *heap = malloc(nthreads * sizeof(*heap));
+    int k = 0;
+    for (int t = 0; t < nthreads; t++)
+        if (chunks[t].n > 0) {
+            heap[k].pos = chunks[t].recs;
+            heap[k].end = chunks[t].recs + chunks[t].n;
+            k++;
+        }
+    for (int i = k / 2 - 1; i >= 0; i--)
+        merge_sift_down(heap, k, i, files);
+
+    for (size_t i = 0; i < n; i++) {
+        out[i] = *heap[0].pos++;
+        if (heap[0].pos == heap[0].end)
+            heap[0] = heap[--k];
+        merge_sift_down(heap, k, 0, files);
+    }
+
+    free(heap);
+    free(threads);
+    free(chunks);
+}
+
+int sort_thread_count(size_t n) {
+    if ((long)n < parallel_sort_min) return 1;
+    int t = sort_threads > 0 ? sort_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    // Keep chunks large enough to be worth a thread.
+    if ((size_t)t > n / 16384) t = n / 16384;
+    return t < 1 ? 1 : t;
+}
+
+void sort_entries(struct dir_listing *list) {
+    size_t n = list->count;
+    if (n < 2) return;
+
+    struct sort_rec *recs = malloc(2 * n * sizeof(*recs));
+    for (size_t i = 0; i < n; i++) {
+        recs[i].key = name_key(&list->files[i], 0);
+        recs[i].idx = i;
+    }
+
+    int nthreads = sort_thread_count(n);
+    struct sort_rec *order = recs;
+    if (nthreads > 1) {
+        parallel_sort_recs(recs, recs + n, n, list->files, nthreads);
+        order = recs + n;
+    } else {
+        msd_sort_recs(recs, recs + n, n, list->files, 0);
+    }
+
+    // Apply the permutation to the entry records.
+    struct file_entry *sorted = malloc(n * sizeof(*sorted));
+    for (size_t i = 0; i < n; i++)
+        sorted[i] = list->files[order[i].idx];
+    free(list->files);
+    list->files = sorted;
+    list->cap = n;
+    free(recs);
+}
+
+// ---------- Size and time order (-S, -t) ----------
+// 64-bit key whose ascending order is the listing order: newest or
+// largest first.
+uint64_t metric_key(const struct file_entry *f) {
+    if (sort_by == SORT_TIME)
+        return ~((uint64_t)f->mtime ^ (1ULL << 63));
+    return ~(uint64_t)f->size;
+}
+
+// Entries are name-sorted first; a stable radix pass on the metric then
+// leaves ties in name order, as GNU ls does. Like GNU ls, -t orders by
+// the full timestamp: a pass on the nanoseconds goes first, so the
+// seconds pass keeps files from the same second newest first.
+void sort_by_metric(struct dir_listing *list) {
+    size_t n = list->count;
+    if (n < 2) return;
+
+    struct sort_rec *recs = malloc(2 * n * sizeof(*recs));
+    for (size_t i = 0; i < n; i++) {
+        recs[i].key = sort_by == SORT_TIME ? ~(uint64_t)list->files[i].mtime_nsec
+                                           : metric_key(&list->files[i]);
+        recs[i].idx = i;
+    }
+    radix_sort_recs(recs, recs + n, n);
+    if (sort_by == SORT_TIME) {
+        for (size_t i = 0; i < n; i++)
+            recs[i].key = metric_key(&list->files[recs[i].idx]);
+        radix_sort_recs(recs, recs + n, n);
+    }
+
+    struct file_entry *sorted = malloc(n * sizeof(*sorted));
+    for (size_t i = 0; i < n; i++)
+        sorted[i] = list->files[recs[i].idx];
+    free(list->files);
+    list->files = sorted;
+    list->cap = n;
+    free(recs);
+}
+
+// ---------- Top-k selection (--head) ----------
+// Full listing order as a comparator: metric (for -t/-S, with -t down
+// to the nanosecond), then sort key, then name.
+int entry_cmp(const struct file_entry *a, const struct file_entry *b) {
+    if (sort_by != SORT_NAME) {
+        uint64_t ka = metric_key(a), kb = metric_key(b);
+        if (ka != kb) return ka < kb ? -1 : 1;
+        if (sort_by == SORT_TIME && a->mtime_nsec != b->mtime_nsec)
+            return a->mtime_nsec > b->mtime_nsec ? -1 : 1;
+    }
+    int cmp = strcmp(a->key, b->key);
+    return cmp ? cmp : strcmp(a->name, b->name);
+}
+
+int entry_qsort_cmp(const void *a, const void *b) {
+    return entry_cmp(a, b);
+}
+
+// Sift down in a heap of entry indices whose root is the entry that
+// sorts last.
+void top_sift_down(int *heap, int k, int i, const struct file_entry *files) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, max = i;
+        if (l < k && entry_cmp(&files[heap[l]], &files[heap[max]]) > 0) max = l;
+        if (r < k && entry_cmp(&files[heap[r]], &files[heap[max]]) > 0) max = r;
+        if (max == i) return;
+        int t = heap[i];
+        heap[i] = heap[max];
+        heap[max] = t;
+        i = max;
+    }
+}
+
+// Keep only the first k entries in listing order, in O(n log k): a
+// bounded heap holds the k best seen so far with the worst on top.
+void select_top(struct dir_listing *list, int k) {
+    int n = list->count;
+    int *heap = malloc(k * sizeof(*heap));
+
+    for (int i = 0; i < k; i++) heap[i] = i;
+    for (int i = k / 2 - 1; i >= 0; i--)
+        top_sift_down(heap, k, i, list->files);
+    for (int i = k; i < n; i++) {
+        if (entry_cmp(&list->files[i], &list->files[heap[0]]) < 0) {
+            heap[0] = i;
+            top_sift_down(heap, k, 0, list->files);
+        }
+    }
+
+    struct file_entry *top = malloc(k * sizeof(*top));
+    for (int i = 0; i < k; i++)
+        top[i] = list->files[heap[i]];
+    qsort(top, k, sizeof(*top), entry_qsort_cmp);
+
+    free(list->files);
+    free(heap);
+    list->files = top;
+    list->count = list->cap = k;
+}
+
+// Put a gathered listing in display order.
+void sort_listing(struct dir_listing *list) {
+    if (head_limit > 0 && head_limit < list->count) {
+        select_top(list, head_limit);
+        return;
+    }
+    sort_entries(list);
+    if (sort_by != SORT_NAME)
+        sort_by_metric(list);
+}
+
+// ================== Entry Type ==================
+// Turn a d_type into the S_IFMT bits of a mode. DT_UNKNOWN (some
+// filesystems never fill d_type) maps to 0 so callers fall back to lstat.
+mode_t dtype_to_mode(unsigned char d_type) {
+    switch (d_type) {
+        case DT_DIR:  return S_IFDIR;
+        case DT_LNK:  return S_IFLNK;
+        case DT_REG:  return S_IFREG;
+        case DT_CHR:  return S_IFCHR;
+        case DT_BLK:  return S_IFBLK;
+        case DT_FIFO: return S_IFIFO;
+        case DT_SOCK: return S_IFSOCK;
+        default:      return 0;
+    }
+}
+
+// ================== Colors (LS_COLORS) ==================
+// Type keys LS_COLORS understands, in CT_* order.
+const char *color_keys[CT_COUNT] = {
+    "fi", "di", "ln", "pi", "so", "bd", "cd", "ex",
+    "su", "sg", "st", "ow", "tw", "rs"
+};
+
+// code == "01;34" becomes "\033[01;34m"; an empty code means uncolored.
+void color_set(struct color_seq *c, const char *code, int len) {
+    free(c->seq);
+    c->seq = NULL;
+    c->len = 0;
+    if (len == 0) return;
+
+    c->seq = malloc(len + 4);
+    c->len = snprintf(c->seq, len + 4, "\033[%.*sm", len, code);
+}
+
+// FNV-1a
+size_t suffix_hash(const char *s, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+struct color_ext *color_ext_find(const char *suffix, int len) {
+    size_t mask = colors.ext_cap - 1;
+    size_t i = suffix_hash(suffix, len) & mask;
+    while (colors.exts[i].suffix &&
+           (colors.exts[i].len != len || memcmp(colors.exts[i].suffix, suffix, len) != 0))
+        i = (i + 1) & mask;
+    return &colors.exts[i];
+}
+
+void color_ext_grow(void) {
+    struct color_ext *old = colors.exts;
+    size_t old_cap = colors.ext_cap;
+
+    colors.ext_cap = old_cap ? old_cap * 2 : 64;
+    colors.exts = calloc(colors.ext_cap, sizeof(*colors.exts));
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i].suffix)
+            *color_ext_find(old[i].suffix, old[i].len) = old[i];
+    free(old);
+}
+
+// Later entries for the same suffix replace earlier ones.
+void color_ext_add(const char *suffix, int len, const char *code, int code_len) {
+    if (len == 0) return;
+    if (colors.ext_count * 2 >= colors.ext_cap)
+        color_ext_grow();
+
+    struct color_ext *e = color_ext_find(suffix, len);
+    if (!e->suffix) {
+        e->suffix = strndup(suffix, len);
+        e->len = len;
+        colors.ext_count++;
+        if (suffix[0] != '.') {
+            int k = 0;
+            while (k < colors.nodd && colors.odd_lens[k] != len) k++;
+            if (k == colors.nodd) {
+                colors.odd_lens = realloc(colors.odd_lens, (k + 1) * sizeof(int));
+                colors.odd_lens[colors.nodd++] = len;
+            }
+        }
+    }
+    color_set(&e->color, code, code_len);
+}
+
+// Apply "key=code:key=code:..."; unknown keys are ignored.
+void parse_colors(const char *spec) {
+    while (*spec) {
+        const char *end = strchr(spec, ':');
+        if (!end) end = spec + strlen(spec);
+        const char *eq = memchr(spec, '=', end - spec);
+
+        if (eq) {
+            int klen = eq - spec, clen = end - eq - 1;
+            if (spec[0] == '*') {
+                color_ext_add(spec + 1, klen - 1, eq + 1, clen);
+            } else if (klen == 2 && memcmp(spec, "ln", 2) == 0 &&
+                       clen == 6 && memcmp(eq + 1, "target", 6) == 0) {
+                colors.link_target = 1;
+            } else if (klen == 2) {
+                for (int t = 0; t < CT_COUNT; t++)
+                    if (memcmp(spec, color_keys[t], 2) == 0)
+                        color_set(&colors.types[t], eq + 1, clen);
+                if (memcmp(spec, "ln", 2) == 0)
+                    colors.link_target = 0;
+            }
+        }
+        spec = *end ? end + 1 : end;
+    }
+}
+
+void init_colors(void) {
+    const char *env = getenv("LS_COLORS");
+
+    color_ext_grow();
+    parse_colors(DEFAULT_TYPE_COLORS);
+    parse_colors(env ? env : DEFAULT_EXT_COLORS);
+    colors.dir_modes = colors.types[CT_STICKY].seq || colors.types[CT_OTHER_WRITABLE].seq ||
+                       colors.types[CT_STICKY_OTHER_WRITABLE].seq;
+}
+
+// Color configured for the longest matching suffix of name, or NULL.
+// Suffixes starting with '.' can only begin at a '.' in the name, so
+// only those positions are probed (longest first); other suffixes are
+// tried once per distinct configured length.
+const struct color_seq *suffix_color(const char *name, int len) {
+    for (const char *p = memchr(name, '.', len); p; ) {
+        int slen = len - (p - name);
+        struct color_ext *e = color_ext_find(p, slen);
+        if (e->suffix) return &e->color;
+        p = slen > 1 ? memchr(p + 1, '.', slen - 1) : NULL;
+    }
+    for (int k = 0; k < colors.nodd; k++) {
+        int slen = colors.odd_lens[k];
+        if (slen > len) continue;
+        struct color_ext *e = color_ext_find(name + len - slen, slen);
+        if (e->suffix) return &e->color;
+    }
+    return NULL;
+}
+
+// Same precedence as GNU ls: special permission colors only apply when
+// they are set, and suffixes only color plain regular files.
+const struct color_seq *color_for(const struct file_entry *f) {
+    const struct color_seq *t = colors.types;
+    mode_t mode = f->mode;
+
+    if (S_ISDIR(mode)) {
+        int sticky = mode & S_ISVTX, writable = mode & S_IWOTH;
+        if (sticky && writable && t[CT_STICKY_OTHER_WRITABLE].seq)
+            return &t[CT_STICKY_OTHER_WRITABLE];
+        if (writable && t[CT_OTHER_WRITABLE].seq)
+            return &t[CT_OTHER_WRITABLE];
+        if (sticky && t[CT_STICKY].seq)
+            return &t[CT_STICKY];
+        return &t[CT_DIR];
+    }
+    if (S_ISLNK(mode))  return colors.link_target ? f->link_color : &t[CT_LINK];
+    if (S_ISFIFO(mode)) return &t[CT_FIFO];
+    if (S_ISSOCK(mode)) return &t[CT_SOCK];
+    if (S_ISBLK(mode))  return &t[CT_BLK];
+    if (S_ISCHR(mode))  return &t[CT_CHR];
+
+    if ((mode & S_ISUID) && t[CT_SETUID].seq) return &t[CT_SETUID];
+    if ((mode & S_ISGID) && t[CT_SETGID].seq) return &t[CT_SETGID];
+    if (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) return &t[CT_EXEC];
+
+    const struct color_seq *ext = suffix_color(f->name, f->len);
+    return ext ? ext : &t[CT_FILE];
+}
+
+// ================== Print Colored File ==================
+void print_colored_file(struct outbuf *out, const struct file_entry *file) {
+    // No type information (stat failed): print the name as is.
+    const struct color_seq *color = file->mode ? color_for(file) : NULL;
+
+    if (!color || !color->seq) {
+        ob_write(out, file->name, file->len);
+        return;
+    }
+
+    const struct color_seq *reset = &colors.types[CT_RESET];
+    ob_write(out, color->seq, color->len);
+    ob_write(out, file->name, file->len);
+    if (reset->seq)
+        ob_write(out, reset->seq, reset->len);
+}
+
+// ================== Column Layout ==================
+// Columns are as wide as their longest name plus a two-space gap (none
+// after the last one), as in GNU ls, so one long name no longer forces
+// the whole listing into a single column. The layout uses the most
+// columns whose line still fits in width.
+//
+// Every candidate column count is tracked during a single pass over the
+// names: candidate c keeps the widths of its c + 1 columns and its line
+// length, both only ever growing. Candidates past the largest one that
+// still fits are dropped as they overflow, so the pass costs
+// O(entries * candidates alive) rather than a re-layout per candidate.
+void plan_columns(struct column_layout *lay, const struct file_entry *files, int count,
+                  int width, int by_columns) {
+    int max_cols = width / MIN_COLUMN_WIDTH;
+    if (max_cols > count) max_cols = count;
+    if (max_cols < 1) max_cols = 1;
+
+    // Candidate c uses widths[c * (c + 1) / 2 ...] for its columns.
+    int *widths = malloc((size_t)max_cols * (max_cols + 1) / 2 * sizeof(*widths));
+    long *line_len = malloc(max_cols * sizeof(*line_len));
+    for (int c = 0; c < max_cols; c++) {
+        line_len[c] = (long)(c + 1) * MIN_COLUMN_WIDTH;
+        for (int k = 0; k <= c; k++)
+            widths[c * (c + 1) / 2 + k] = MIN_COLUMN_WIDTH;
+    }
+
+    int alive = max_cols;
+    for (int i = 0; i < count; i++) {
+        for (int c = 0; c < alive; c++) {
+            if (line_len[c] >= width) continue;
+            int col = by_columns ? i / ((count + c) / (c + 1)) : i % (c + 1);
+            int len = files[i].len + (col == c ? 0 : 2);
+            int *w = &widths[c * (c + 1) / 2 + col];
+            if (*w < len) {
+                line_len[c] += len - *w;
+                *w = len;
+            }
+        }
+        while (alive > 1 && line_len[alive - 1] >= width)
+            alive--;
+    }
+
+    lay->cols = alive;
+    lay->rows = (count + alive - 1) / alive;
+    lay->widths = malloc(alive * sizeof(*lay->widths));
+    memcpy(lay->widths, &widths[(alive - 1) * alive / 2], alive * sizeof(*lay->widths));
+    free(widths);
+    free(line_len);
+}
+
+// ================== Default Display (Down-Then-Across) ==================
+void display_default(struct outbuf *out, struct file_entry *files, int count) {
+    struct column_layout lay;
+    plan_columns(&lay, files, count, get_terminal_width(), 1);
+
+    for (int r = 0; r < lay.rows; r++) {
+        for (int c = 0; c < lay.cols; c++) {
+            int i = c * lay.rows + r;
+            if (i >= count) break;
+            print_colored_file(out, &files[i]);
+            if (i + lay.rows < count)
+                ob_pad(out, lay.widths[c] - files[i].len);
+        }
+        ob_putc(out, '\n');
+    }
+    free(lay.widths);
+}
+
+// ================== Horizontal Display (-x) ==================
+void display_horizontal(struct outbuf *out, struct file_entry *files, int count) {
+    struct column_layout lay;
+    plan_columns(&lay, files, count, get_terminal_width(), 0);
+
+    for (int i = 0; i < count; i++) {
+        int c = i % lay.cols;
+        print_colored_file(out, &files[i]);
+        if (c == lay.cols - 1 || i == count - 1)
+            ob_putc(out, '\n');
+        else
+            ob_pad(out, lay.widths[c] - files[i].len);
+    }
+    free(lay.widths);
+}
+
+// ================== Long Listing (-l) ==================
+void display_long(struct outbuf *out, struct file_entry *files, int count) {
+    for (int i = 0; i < count; i++)
+        print_long_entry(out, &files[i]);
+}
+
+void print_long_entry(struct outbuf *out, const struct file_entry *f) {
+    if (!f->have_stat) return;
+
+    // File type, permissions and sticky bit
+    ob_mode(out, f->mode);
+
+    ob_putc(out, ' ');
+    ob_num(out, (long)f->nlink, 3);
+    ob_putc(out, ' ');
+    ob_str_left(out, user_name(f->uid), 8);
+    ob_putc(out, ' ');
+    ob_str_left(out, group_name(f->gid), 8);
+    ob_putc(out, ' ');
+    ob_num(out, (long)f->size, 8);
+    ob_putc(out, ' ');
+    char when[12];
+    format_mtime(when, f->mtime);
+    ob_write(out, when, 12);
+    ob_putc(out, ' ');
+    ob_write(out, f->name, f->len);
+    ob_putc(out, '\n');
+}
+
+// ================== JSON Output (--json, --ndjson) ==================
+// One object per entry with everything -l shows, in raw form:
+//   {"name":"a.c","path":"src/a.c","type":"file","ino":1234,"mode":"0644",
+//    "size":42,"mtime":1700000000,"nlink":1,"uid":1000,"user":"me",
+//    "gid":1000,"group":"me"}
+// Fields past "ino" are left out if the entry could not be stat'ed;
+// "user"/"group" are null for ids without a name. --ndjson ends every
+// record with a newline; --json wraps them in an array. Records are
+// written as each directory is listed, so -R (and -U) output streams
+// with the same memory bound as the text formats.
+int is_json(int display_mode) {
+    return display_mode == DISPLAY_JSON || display_mode == DISPLAY_NDJSON;
+}
+
+// Length of the well-formed UTF-8 sequence at p, 0 if there is none
+// (stray continuation bytes, overlong forms, surrogates, > U+10FFFF).
+int utf8_len(const unsigned char *p, size_t avail) {
+    unsigned int cp;
+    int n;
+
+    if (p[0] >= 0xc2 && p[0] <= 0xdf)      { n = 2; cp = p[0] & 0x1f; }
+    else if ((p[0] & 0xf0) == 0xe0)        { n = 3; cp = p[0] & 0x0f; }
+    else if (p[0] >= 0xf0 && p[0] <= 0xf4) { n = 4; cp = p[0] & 0x07; }
+    else return 0;
+    if ((size_t)n > avail) return 0;
+
+    for (int i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) return 0;
+        cp = cp << 6 | (p[i] & 0x3f);
+    }
+    if (n == 3 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) return 0;
+    if (n == 4 && (cp < 0x10000 || cp > 0x10ffff)) return 0;
+    return n;
+}
+
+// Body of a JSON string (no quotes). File names are bytes, not text:
+// a byte that is not part of valid UTF-8 is written as "\udcXX", the
+// surrogateescape convention, so such names still round-trip.
+void ob_json_escape(struct outbuf *out, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *)s, *end = p + len;
+
+    while (p < end) {
+        const unsigned char *run = p;
+        while (p < end && *p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\')
+            p++;
+        ob_write(out, (const char *)run, p - run);
+        if (p == end) break;
+
+        if (*p >= 0x80) {
+            int n = utf8_len(p, end - p);
+            if (n > 0) {
+                ob_write(out, (const char *)p, n);
+                p += n;
+                continue;
+            }
+            char esc[6] = { '\\', 'u', 'd', 'c', hex[*p >> 4], hex[*p & 15] };
+            ob_write(out, esc, 6);
+        } else if (*p == '"' || *p == '\\') {
+            char esc[2] = { '\\', *p };
+            ob_write(out, esc, 2);
+        } else if (*p == '\n') {
+            ob_write(out, "\\n", 2);
+        } else if (*p == '\t') {
+            ob_write(out, "\\t", 2);
+        } else {
+            char esc[6] = { '\\', 'u', '0', '0', hex[*p >> 4], hex[*p & 15] };
+            ob_write(out, esc, 6);
+        }
+        p++;
+    }
+}
+
+const char *json_type(mode_t mode) {
+    if (S_ISREG(mode))  return "file";
+    if (S_ISDIR(mode))  return "dir";
+    if (S_ISLNK(mode))  return "symlink";
+    if (S_ISFIFO(mode)) return "fifo";
+    if (S_ISSOCK(mode)) return "socket";
+    if (S_ISBLK(mode))  return "block";
+    if (S_ISCHR(mode))  return "char";
+    return "unknown";
+}
+
+// ,"key":"name" or ,"key":null
+void ob_json_name(struct outbuf *out, const char *key, const char *name) {
+    ob_printf(out, ",\"%s\":", key);
+    if (!name) {
+        ob_write(out, "null", 4);
+        return;
+    }
+    ob_putc(out, '"');
+    ob_json_escape(out, name, strlen(name));
+    ob_putc(out, '"');
+}
+
+// json_records counts the records already in the stream out belongs to,
+// which decides whether a --json record needs a separator.
+void print_json_entry(struct outbuf *out, const char *dir, const struct file_entry *f,
+                      int display_mode) {
+    if (display_mode == DISPLAY_JSON && json_records > 0)
+        ob_write(out, ",\n", 2);
+    json_records++;
+
+    ob_write(out, "{\"name\":\"", 9);
+    ob_json_escape(out, f->name, f->len);
+    ob_write(out, "\",\"path\":\"", 10);
+    size_t dlen = strlen(dir);
+    ob_json_escape(out, dir, dlen);
+    if (dlen == 0 || dir[dlen - 1] != '/')
+        ob_putc(out, '/');
+    ob_json_escape(out, f->name, f->len);
+    ob_write(out, "\",\"type\":\"", 10);
+    ob_puts(out, json_type(f->mode));
+    ob_write(out, "\",\"ino\":", 8);
+    ob_num(out, (long)f->ino, 0);
+
+    if (f->have_stat) {
+        char mode[] = ",\"mode\":\"0000\"";
+        for (int i = 0; i < 4; i++)
+            mode[9 + i] = '0' + ((f->mode & 07777) >> (9 - 3 * i) & 7);
+        ob_write(out, mode, sizeof(mode) - 1);
+        ob_write(out, ",\"size\":", 8);
+        ob_num(out, (long)f->size, 0);
+        ob_write(out, ",\"mtime\":", 9);
+        ob_num(out, (long)f->mtime, 0);
+        ob_write(out, ",\"nlink\":", 9);
+        ob_num(out, (long)f->nlink, 0);
+        ob_write(out, ",\"uid\":", 7);
+        ob_num(out, (long)f->uid, 0);
+        ob_json_name(out, "user", id_cache_get(&user_cache, f->uid, lookup_user));
+        ob_write(out, ",\"gid\":", 7);
+        ob_num(out, (long)f->gid, 0);
+        ob_json_name(out, "group", id_cache_get(&group_cache, f->gid, lookup_group));
+    }
+
+    ob_putc(out, '}');
+    if (display_mode == DISPLAY_NDJSON)
+        ob_putc(out, '\n');
+}
+
+void display_json(struct outbuf *out, const char *dir, struct file_entry *files, int count,
+                  int display_mode) {
+    for (int i = 0; i < count; i++)
+        print_json_entry(out, dir, &files[i], display_mode);
+}
+
+// ================== List One Directory ==================
+// Gather, stat, sort and render one directory to out. The sorted records
+// are handed back so -R can pick the subdirectories from them.
+int list_directory(struct outbuf *out, int dirfd, const char *path, int display_mode,
+                   struct dir_listing *list) {
+    if (gather_filenames(dirfd, list) == -1)
+        return -1;
+
+    stat_entries(dirfd, list->files, list->count, stat_need(display_mode));
+    show_listing(out, path, display_mode, list);
+    return 0;
+}
+
+// Sort a gathered listing and render it.
+void show_listing(struct outbuf *out, const char *path, int display_mode,
+                  struct dir_listing *list) {
+    uint64_t t = prof_start();
+    if (collate)
+        collate_keys(list);
+    sort_listing(list);
+    prof_end(PROF_SORT, t);
+
+    display_entries(out, path, display_mode, list->files, list->count);
+}
+
+// Render entries that are already in display order.
+void display_entries(struct outbuf *out, const char *path, int display_mode,
+                     struct file_entry *files, int count) {
+    uint64_t t = prof_start();
+    if (display_mode == DISPLAY_LONG) {
+        display_long(out, files, count);
+        prof_end(PROF_FORMAT, t);
+    } else if (is_json(display_mode)) {
+        display_json(out, path, files, count, display_mode);
+        prof_end(PROF_FORMAT, t);
+    } else {
+        if (display_mode == DISPLAY_HORIZONTAL)
+            display_horizontal(out, files, count);
+        else
+            display_default(out, files, count);
+        prof_end(PROF_LAYOUT, t);
+    }
+}
+
+// ================== Unsorted Streaming (-U, -f) ==================
+// Print entries in the order getdents returns them, without collecting
+// the directory first. Memory stays bounded by the reader buffer plus
+// the subdirectory names kept for -R, and output is flushed after every
+// getdents batch so the first lines appear right away. Column layouts
+// need every name up front, so plain and -x output fill each line
+// greedily instead, two spaces between names.
+int stream_directory(struct outbuf *out, int dirfd, const char *path, int display_mode,
+                     struct dir_listing *subdirs) {
+    memset(subdirs, 0, sizeof(*subdirs));
+
+    struct dir_reader reader;
+    if (dir_reader_open(&reader, dirfd) == -1) {
+        perror("opendir");
+        return -1;
+    }
+
+    int need = display_mode == DISPLAY_LONG || is_json(display_mode) ? STAT_FULL : STAT_COLOR;
+    int width = get_terminal_width();
+    int curr_width = 0;
+    long shown = 0;
+    struct dir_record rec;
+    struct file_entry f;
+
+    while ((head_limit == 0 || shown < head_limit) &&
+           dir_reader_next(&reader, &rec) == 1) {
+        if (!is_listed(rec.name)) continue;
+        shown++;
+        prof.entries++;
+        entry_from_record(&f, &rec);
+        stat_entries(dirfd, &f, 1, need);
+
+        if (display_mode == DISPLAY_LONG) {
+            print_long_entry(out, &f);
+        } else if (is_json(display_mode)) {
+            print_json_entry(out, path, &f, display_mode);
+        } else {
+            if (curr_width > 0 && curr_width + 2 + f.len > width) {
+                ob_putc(out, '\n');
+                curr_width = 0;
+            } else if (curr_width > 0) {
+                ob_pad(out, 2);
+                curr_width += 2;
+            }
+            print_colored_file(out, &f);
+            curr_width += f.len;
+        }
+
+        if (is_subdir(&f))
+            listing_append(subdirs, &f);
+        if (!dir_reader_pending(&reader))
+            ob_flush(out);
+    }
+    if (curr_width > 0)
+        ob_putc(out, '\n');
+
+    dir_reader_close(&reader);
+    listing_finish(subdirs);
+    return 0;
+}
+
+// List one directory in the active mode. For -U/-f the listing that
+// comes back holds only the subdirectories.
+int render_directory(struct outbuf *out, int dirfd, const char *path, int display_mode,
+                     struct dir_listing *list) {
+    prof.dirs++;
+    if (unsorted)
+        return stream_directory(out, dirfd, path, display_mode, list);
+    if (active_index && index_listing(dirfd, path, list) == 0) {
+        show_listing(out, path, display_mode, list);
+        return 0;
+    }
+    return list_directory(out, dirfd, path, display_mode, list);
+}
+
+// True for entries -R descends into.
+int is_subdir(const struct file_entry *f) {
+    if (!S_ISDIR(f->mode)) return 0;
+    return strcmp(f->name, ".") != 0 && strcmp(f->name, "..") != 0;
+}
+
+// Shrink a printed listing down to the entries -R descends into. The
+// records already know which entries are directories, so no further
+// lstat is needed. The subdirectory names move to a fresh arena and
+// the full one is released, so a huge directory does not stay resident
+// while its (usually few) subdirectories are walked.
+void keep_subdirs(struct dir_listing *list) {
+    struct dir_listing subdirs;
+
+    memset(&subdirs, 0, sizeof(subdirs));
+    for (int i = 0; i < list->count; i++)
+        if (is_subdir(&list->files[i]))
+            listing_append(&subdirs, &list->files[i]);
+    listing_finish(&subdirs);
+
+    free_listing(list);
+    *list = subdirs;
+}
+
+// True for subdirectory names --prune keeps -R out of.
+int is_pruned(const char *name) {
+    for (int i = 0; i < nprune; i++)
+        if (fnmatch(prune_patterns[i], name, 0) == 0)
+            return 1;
+    return 0;
+}
+
+// ---------- Directory identity set ----------
+// Open addressing with linear probing; removal shifts the following
+// run back so lookups never need tombstones.
+size_t dir_id_slot(struct dir_id id, size_t cap) {
+    uint64_t h = (uint64_t)id.ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)id.dev;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return h & (cap - 1);
+}
+
+int dir_id_equal(struct dir_id a, struct dir_id b) {
+    return a.dev == b.dev && a.ino == b.ino;
+}
+
+void dir_id_grow(struct dir_id_set *s) {
+    struct dir_id_set old = *s;
+    s->cap = old.cap ? old.cap * 2 : 64;
+    s->ids = malloc(s->cap * sizeof(*s->ids));
+    s->used = calloc(s->cap, 1);
+    s->count = 0;
+    for (size_t i = 0; i < old.cap; i++)
+        if (old.used[i])
+            dir_id_add(s, old.ids[i]);
+    free(old.ids);
+    free(old.used);
+}
+
+// 0 if id is already in the set.
+int dir_id_add(struct dir_id_set *s, struct dir_id id) {
+    if (2 * (s->count + 1) > s->cap)
+        dir_id_grow(s);
+    size_t i = dir_id_slot(id, s->cap);
+    for (; s->used[i]; i = (i + 1) & (s->cap - 1))
+        if (dir_id_equal(s->ids[i], id))
+            return 0;
+    s->ids[i] = id;
+    s->used[i] = 1;
+    s->count++;
+    return 1;
+}
+
+void dir_id_remove(struct dir_id_set *s, struct dir_id id) {
+    if (s->cap == 0) return;
+    size_t mask = s->cap - 1, i = dir_id_slot(id, s->cap);
+    for (; s->used[i]; i = (i + 1) & mask)
+        if (dir_id_equal(s->ids[i], id))
+            break;
+    if (!s->used[i]) return;
+
+    // Move back every later member of the run whose home slot does not
+    // lie between the hole and its current slot.
+    for (size_t j = (i + 1) & mask; s->used[j]; j = (j + 1) & mask) {
+        size_t home = dir_id_slot(s->ids[j], s->cap);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            s->ids[i] = s->ids[j];
+            i = j;
+        }
+    }
+    s->used[i] = 0;
+    s->count--;
+}
+
+int dir_id_of(int fd, struct dir_id *id) {
+    struct stat st;
+    prof.fstats++;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    id->dev = st.st_dev;
+    id->ino = st.st_ino;
+    return 0;
+}
+
+void report_cycle(const char *path) {
+    fprintf(stderr, "%s: not listing already-listed directory\n", path);
+}
+
+// ================== Recursive Listing (-R) ==================
+// Print one directory of the walk; path is taken over. If it has
+// subdirectories left to visit (and --max-depth allows it) a frame is
+// pushed for them, otherwise everything is released right away.
+void walk_enter(struct dir_stack *st, int parent_fd, const char *name, char *path,
+                int depth, int display_mode) {
+    struct dir_listing list;
+    struct dir_id id;
+
+    // JSON records carry their own path; no headers or blank lines.
+    if (!is_json(display_mode)) {
+        ob_puts(&stdout_buf, path);
+        ob_write(&stdout_buf, ":\n", 2);
+    }
+
+    int fd = open_dir_at(parent_fd, name);
+    if (fd == -1) {
+        free(path);
+        return;
+    }
+    if (dir_id_of(fd, &id) == -1) {
+        close(fd);
+        free(path);
+        return;
+    }
+    if (!dir_id_add(&st->active, id)) {
+        report_cycle(path);
+        close(fd);
+        free(path);
+        return;
+    }
+    if (render_directory(&stdout_buf, fd, path, display_mode, &list) == -1) {
+        dir_id_remove(&st->active, id);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    // The block is printed; only the subdirectories have to stay alive
+    // while we descend.
+    keep_subdirs(&list);
+    if (list.count == 0 || depth == max_depth) {
+        free_listing(&list);
+        dir_id_remove(&st->active, id);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    push_frame(st, fd, path, &list, depth, id);
+}
+
+void push_frame(struct dir_stack *st, int fd, char *path, struct dir_listing *subdirs,
+                int depth, struct dir_id id) {
+    if (st->count == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 64;
+        st->frames = realloc(st->frames, st->cap * sizeof(*st->frames));
+    }
+    struct dir_frame *f = &st->frames[st->count++];
+    f->fd = fd;
+    f->path = path;
+    f->subdirs = *subdirs;
+    f->next = 0;
+    f->depth = depth;
+    f->id = id;
+}
+
+void frame_skip_pruned(struct dir_frame *f) {
+    while (f->next < f->subdirs.count && is_pruned(f->subdirs.files[f->next].name))
+        f->next++;
+}
+
+// The frame's next subdirectory, or NULL when done. Pruned names are
+// skipped on both sides, so next == count right after the last one.
+const struct file_entry *frame_next(struct dir_frame *f) {
+    frame_skip_pruned(f);
+    if (f->next == f->subdirs.count)
+        return NULL;
+    const struct file_entry *child = &f->subdirs.files[f->next++];
+    frame_skip_pruned(f);
+    return child;
+}
+
+// Once its last subdirectory is open a frame only has to stay on the
+// stack for the cycle check, so a long chain of single subdirectories
+// holds a handful of descriptors instead of one per level.
+void frame_release(struct dir_frame *f) {
+    if (f->fd != -1) close(f->fd);
+    f->fd = -1;
+    free(f->path);
+    f->path = NULL;
+    free_listing(&f->subdirs);
+    f->next = 0;
+}
+
+void do_ls(const char *dir, int display_mode) {
+    struct dir_stack st;
+    memset(&st, 0, sizeof(st));
+
+    walk_enter(&st, AT_FDCWD, dir, strdup(dir), 0, display_mode);
+    while (st.count > 0) {
+        int top = st.count - 1;
+        struct dir_frame *f = &st.frames[top];
+        const struct file_entry *child = frame_next(f);
+        if (!child) {
+            frame_release(f);
+            dir_id_remove(&st.active, f->id);
+            st.count--;
+            continue;
+        }
+
+        if (!is_json(display_mode))
+            ob_putc(&stdout_buf, '\n');
+        walk_enter(&st, f->fd, child->name, join_path(f->path, child->name),
+                   f->depth + 1, display_mode);
+
+        // walk_enter may have moved the frames.
+        f = &st.frames[top];
+        if (f->fd != -1 && f->next == f->subdirs.count)
+            frame_release(f);
+    }
+
+    free_dir_stack(&st);
+}
+
+void free_dir_stack(struct dir_stack *st) {
+    free(st->frames);
+    free(st->active.ids);
+    free(st->active.used);
+}
+
+// ================== Parallel Recursive Listing (-j) ==================
+// Worker threads list directories concurrently. Each directory becomes a
+// dir_node whose rendered block is buffered in memory; the main thread
+// walks the node tree in the same pre-order as do_ls and writes each
+// block as soon as it is ready, so the output is byte-identical to the
+// serial -R listing.
+//
+// A directory is opened relative to its parent's descriptor, which is
+// shared through a reference-counted dir_handle and closed once the last
+// child has been opened.
+//
+// Every worker owns a deque of pending directories. It pushes the
+// subdirectories it discovers onto its own end and pops from there
+// (depth-first, close to the order the output is consumed in); idle
+// workers steal from the other end of someone else's deque.
+//
+// Branches are listed concurrently, so there is no single set of
+// directories on "the" current path; a node checks for cycles by
+// walking its own chain of ancestors instead, which stay allocated
+// until their whole subtree has been written.
+struct dir_handle {
+    int fd;
+    int refs;
+};
+
+struct dir_node {
+    struct dir_handle *parent;   // NULL for the command-line directory
+    struct dir_node *up;         // the parent's node
+    char *name;                  // opened relative to parent
+    char *path;
+    int depth;
+    struct dir_id id;
+    struct outbuf block;         // "path:\n" followed by the listing
+    struct dir_node **children;  // subdirectories in sorted order
+    int nchildren;
+    long records;                // JSON records in block
+    int next_child;              // emit_walk: children written so far
+    int done;                    // block and children are final
+};
+
+struct work_deque {
+    pthread_mutex_t lock;
+    struct dir_node **items;     // live range is items[head..tail)
+    int head, tail, cap;
+};
+
+struct parallel_walk {
+    int nworkers;
+    int display_mode;
+    struct work_deque *deques;
+    long queued;                 // nodes sitting in some deque
+    long pending;                // nodes not yet fully processed
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+};
+
+struct parallel_walk walk = {
+    .idle_lock = PTHREAD_MUTEX_INITIALIZER,
+    .idle_cond = PTHREAD_COND_INITIALIZER,
+    .done_lock = PTHREAD_MUTEX_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+void deque_push(struct work_deque *dq, struct dir_node *node) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap) {
+        if (dq->head > 0) {
+            memmove(dq->items, dq->items + dq->head,
+                    (dq->tail - dq->head) * sizeof(*dq->items));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            dq->cap = dq->cap ? dq->cap * 2 : 64;
+            dq->items = realloc(dq->items, dq->cap * sizeof(*dq->items));
+        }
+    }
+    dq->items[dq->tail++] = node;
+    pthread_mutex_unlock(&dq->lock);
+
+    __atomic_add_fetch(&walk.queued, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&walk.idle_lock);
+    pthread_cond_broadcast(&walk.idle_cond);
+    pthread_mutex_unlock(&walk.idle_lock);
+}
+
+// Owner end (LIFO) when steal == 0, thief end (FIFO) otherwise.
+struct dir_node *deque_take(struct work_deque *dq, int steal) {
+    struct dir_node *node = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail)
+        node = steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+    pthread_mutex_unlock(&dq->lock);
+    if (node) __atomic_sub_fetch(&walk.queued, 1, __ATOMIC_SEQ_CST);
+    return node;
+}
+
+// Next directory for worker id, or NULL once the whole tree is done.
+struct dir_node *take_work(int id) {
+    for (;;) {
+        struct dir_node *node = deque_take(&walk.deques[id], 0);
+        for (int k = 1; !node && k < walk.nworkers; k++)
+            node = deque_take(&walk.deques[(id + k) % walk.nworkers], 1);
+        if (node) return node;
+
+        pthread_mutex_lock(&walk.idle_lock);
+        while (__atomic_load_n(&walk.queued, __ATOMIC_SEQ_CST) == 0 &&
+               __atomic_load_n(&walk.pending, __ATOMIC_SEQ_CST) > 0)
+            pthread_cond_wait(&walk.idle_cond, &walk.idle_lock);
+        int finished = __atomic_load_n(&walk.pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&walk.idle_lock);
+        if (finished) return NULL;
+    }
+}
+
+void release_dir_handle(struct dir_handle *h) {
+    if (h && __atomic_sub_fetch(&h->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+        close(h->fd);
+        free(h);
+    }
+}
+
+// A node for up->path/name; with up == NULL, name is the command-line
+// directory and is used as the path unchanged.
+struct dir_node *new_dir_node(struct dir_node *up, struct dir_handle *parent,
+                              const char *name) {
+    struct dir_node *node = calloc(1, sizeof(*node));
+    node->parent = parent;
+    node->up = up;
+    node->name = strdup(name);
+    node->path = up ? join_path(up->path, name) : strdup(name);
+    node->depth = up ? up->depth + 1 : 0;
+    if (parent) __atomic_add_fetch(&parent->refs, 1, __ATOMIC_SEQ_CST);
+    return node;
+}
+
+int is_ancestor(const struct dir_node *node, struct dir_id id) {
+    for (const struct dir_node *a = node->up; a; a = a->up)
+        if (dir_id_equal(a->id, id))
+            return 1;
+    return 0;
+}
+
+void process_dir_node(int id, struct dir_node *node) {
+    struct dir_listing list;
+
+    struct outbuf *out = &node->block;
+    ob_init(out, -1);
+    if (!is_json(walk.display_mode)) {
+        ob_puts(out, node->path);
+        ob_write(out, ":\n", 2);
+    }
+    json_records = 0;
+
+    int fd = open_dir_at(node->parent ? node->parent->fd : AT_FDCWD, node->name);
+    release_dir_handle(node->parent);
+    if (fd != -1 && dir_id_of(fd, &node->id) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd != -1 && is_ancestor(node, node->id)) {
+        report_cycle(node->path);
+        close(fd);
+        fd = -1;
+    }
+    if (fd != -1) {
+        // Our own reference keeps the handle alive while children are
+        // created; each child takes one more.
+        struct dir_handle *self = malloc(sizeof(*self));
+        self->fd = fd;
+        self->refs = 1;
+        if (render_directory(out, fd, node->path, walk.display_mode, &list) == 0) {
+            for (int i = 0; i < list.count && node->depth != max_depth; i++) {
+                if (!is_subdir(&list.files[i]) || is_pruned(list.files[i].name)) continue;
+                node->children = realloc(node->children,
+                                         (node->nchildren + 1) * sizeof(*node->children));
+                node->children[node->nchildren++] =
+                    new_dir_node(node, self, list.files[i].name);
+            }
+            free_listing(&list);
+        }
+        release_dir_handle(self);
+    }
+    node->records = json_records;
+
+    // Queue the children before this node stops counting as pending so
+    // the walk cannot look finished in between. Pushing them in reverse
+    // lets the owner pop the first subdirectory next.
+    __atomic_add_fetch(&walk.pending, node->nchildren, __ATOMIC_SEQ_CST);
+    for (int i = node->nchildren - 1; i >= 0; i--)
+        deque_push(&walk.deques[id], node->children[i]);
+
+    pthread_mutex_lock(&walk.done_lock);
+    node->done = 1;
+    pthread_cond_broadcast(&walk.done_cond);
+    pthread_mutex_unlock(&walk.done_lock);
+
+    if (__atomic_sub_fetch(&walk.pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&walk.idle_lock);
+        pthread_cond_broadcast(&walk.idle_cond);
+        pthread_mutex_unlock(&walk.idle_lock);
+    }
+}
+
+void *walk_worker(void *arg) {
+    int id = (int)(intptr_t)arg;
+    struct dir_node *node;
+    while ((node = take_work(id)) != NULL)
+        process_dir_node(id, node);
+    dir_reader_free_buffer();
+    uring_free();
+    prof_merge();
+    return NULL;
+}
+
+// Write node's block once it is final.
+void emit_dir_node(struct dir_node *node) {
+    pthread_mutex_lock(&walk.done_lock);
+    while (!node->done)
+        pthread_cond_wait(&walk.done_cond, &walk.done_lock);
+    pthread_mutex_unlock(&walk.done_lock);
+
+    // Blocks hold their records without a leading separator; the JSON
+    // array separators between blocks are added here.
+    if (walk.display_mode == DISPLAY_JSON && json_records > 0 && node->records > 0)
+        ob_write(&stdout_buf, ",\n", 2);
+    json_records += node->records;
+    ob_write(&stdout_buf, node->block.buf, node->block.len);
+    ob_free(&node->block);
+}
+
+// Write the blocks in do_ls order. A node is freed only after its whole
+// subtree is written, which keeps the ancestor chains valid for the
+// workers.
+void emit_walk(struct dir_node *root) {
+    struct dir_node **stack = malloc(64 * sizeof(*stack));
+    int count = 0, cap = 64;
+
+    emit_dir_node(root);
+    stack[count++] = root;
+    while (count > 0) {
+        struct dir_node *node = stack[count - 1];
+        if (node->next_child == node->nchildren) {
+            free(node->children);
+            free(node->name);
+            free(node->path);
+            free(node);
+            count--;
+            continue;
+        }
+
+        struct dir_node *child = node->children[node->next_child++];
+        if (!is_json(walk.display_mode))
+            ob_putc(&stdout_buf, '\n');
+        emit_dir_node(child);
+        if (count == cap) {
+            cap *= 2;
+            stack = realloc(stack, cap * sizeof(*stack));
+        }
+        stack[count++] = child;
+    }
+    free(stack);
+}
+
+void do_ls_parallel(const char *dir, int display_mode, int jobs) {
+    walk.nworkers = jobs;
+    walk.display_mode = display_mode;
+    walk.deques = calloc(jobs, sizeof(*walk.deques));
+    for (int i = 0; i < jobs; i++)
+        pthread_mutex_init(&walk.deques[i].lock, NULL);
+
+    struct dir_node *root = new_dir_node(NULL, NULL, dir);
+    walk.pending = 1;
+    deque_push(&walk.deques[0], root);
+
+    // Run with whichever workers could be started; every deque can be
+    // stolen from, so ownerless ones are still drained. With none at
+    // all the tree is listed by the serial walk.
+    pthread_t *threads = malloc(jobs * sizeof(*threads));
+    int started = 0;
+    for (int i = 0; i < jobs; i++)
+        if (pthread_create(&threads[started], NULL, walk_worker,
+                           (void *)(intptr_t)started) == 0)
+            started++;
+
+    if (started > 0) {
+        emit_walk(root);
+    } else {
+        free(root->name);
+        free(root->path);
+        free(root);
+        walk.queued = walk.pending = 0;
+        do_ls(dir, display_mode);
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < jobs; i++) {
+        pthread_mutex_destroy(&walk.deques[i].lock);
+        free(walk.deques[i].items);
+    }
+    free(walk.deques);
+    free(threads);
+}
+
+// ================== Directory Index (--build-index, --from-index) ==================
+// The index trusts a directory as long as its mtime (and inode) match
+// the snapshot. That catches entries being added, removed or renamed,
+// but not a file's own size or mtime changing in place: those fields
+// are as of the snapshot. -U always reads the directories themselves.
+struct index_builder {
+    struct index_dir *dirs;
+    size_t ndirs, dirs_cap;
+    struct index_entry *entries;
+    size_t nentries, entries_cap;
+    char *strings;
+    size_t strings_used, strings_cap;
+    int failed;                 // directories that could not be read
+};
+
+uint64_t index_add_string(struct index_builder *b, const char *s, size_t len) {
+    if (b->strings_used + len + 1 > b->strings_cap) {
+        while (b->strings_used + len + 1 > b->strings_cap)
+            b->strings_cap = b->strings_cap ? b->strings_cap * 2 : 65536;
+        b->strings = realloc(b->strings, b->strings_cap);
+    }
+    uint64_t off = b->strings_used;
+    memcpy(b->strings + off, s, len);
+    b->strings[off + len] = '\0';
+    b->strings_used += len + 1;
+    return off;
+}
+
+// Snapshot the directory name (opened relative to parent_fd); path is
+// taken over. Like walk_enter it pushes a frame when there are
+// subdirectories to visit.
+void index_enter(struct index_builder *b, struct dir_stack *ds, int parent_fd,
+                 const char *name, char *path) {
+    struct dir_listing list;
+    struct stat st;
+    struct dir_id id;
+
+    int fd = open_dir_at(parent_fd, name);
+    if (fd == -1) {
+        b->failed++;
+        free(path);
+        return;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        b->failed++;
+        close(fd);
+        free(path);
+        return;
+    }
+    id.dev = st.st_dev;
+    id.ino = st.st_ino;
+    if (!dir_id_add(&ds->active, id)) {
+        report_cycle(path);
+        close(fd);
+        free(path);
+        return;
+    }
+    if (gather_filenames(fd, &list) == -1) {
+        b->failed++;
+        dir_id_remove(&ds->active, id);
+        close(fd);
+        free(path);
+        return;
+    }
+    stat_entries(fd, list.files, list.count, STAT_FULL);
+
+    if (b->ndirs == b->dirs_cap) {
+        b->dirs_cap = b->dirs_cap ? b->dirs_cap * 2 : 1024;
+        b->dirs = realloc(b->dirs, b->dirs_cap * sizeof(*b->dirs));
+    }
+    struct index_dir *d = &b->dirs[b->ndirs++];
+    memset(d, 0, sizeof(*d));
+    d->path_len = strlen(path);
+    d->path_off = index_add_string(b, path, d->path_len);
+    d->nentries = list.count;
+    d->first = b->nentries;
+    d->mtime_sec = st.st_mtim.tv_sec;
+    d->mtime_nsec = st.st_mtim.tv_nsec;
+    d->ino = st.st_ino;
+    d->dev = st.st_dev;
+
+    if (b->nentries + list.count > b->entries_cap) {
+        while (b->nentries + list.count > b->entries_cap)
+            b->entries_cap = b->entries_cap ? b->entries_cap * 2 : 16384;
+        b->entries = realloc(b->entries, b->entries_cap * sizeof(*b->entries));
+    }
+    for (int i = 0; i < list.count; i++) {
+        const struct file_entry *f = &list.files[i];
+        struct index_entry *e = &b->entries[b->nentries++];
+        memset(e, 0, sizeof(*e));
+        e->name_off = index_add_string(b, f->name, f->len);
+        e->name_len = f->len;
+        e->mode = f->mode;
+        e->uid = f->uid;
+        e->gid = f->gid;
+        e->have_stat = f->have_stat;
+        e->d_type = f->d_type;
+        e->size = f->size;
+        e->mtime = f->mtime;
+        e->mtime_nsec = f->mtime_nsec;
+        e->nlink = f->nlink;
+        e->ino = f->ino;
+        e->dev = f->dev;
+    }
+
+    keep_subdirs(&list);
+    if (list.count == 0) {
+        free_listing(&list);
+        dir_id_remove(&ds->active, id);
+        close(fd);
+        free(path);
+        return;
+    }
+    push_frame(ds, fd, path, &list, 0, id);
+}
+
+// Snapshot root and everything below it, dot files included, with the
+// same explicit stack as -R: depth costs no C stack, and a chain of
+// single subdirectories keeps only a few descriptors open.
+void index_scan(struct index_builder *b, const char *root) {
+    struct dir_stack ds;
+    memset(&ds, 0, sizeof(ds));
+
+    index_enter(b, &ds, AT_FDCWD, root, strdup(root));
+    while (ds.count > 0) {
+        int top = ds.count - 1;
+        struct dir_frame *f = &ds.frames[top];
+        const struct file_entry *child = frame_next(f);
+        if (!child) {
+            frame_release(f);
+            dir_id_remove(&ds.active, f->id);
+            ds.count--;
+            continue;
+        }
+
+        index_enter(b, &ds, f->fd, child->name, join_path(f->path, child->name));
+        f = &ds.frames[top];
+        if (f->fd != -1 && f->next == f->subdirs.count)
+            frame_release(f);
+    }
+    free_dir_stack(&ds);
+}
+
+const char *index_sort_strings;     // for index_dir_cmp
+
+int index_dir_cmp(const void *a, const void *b) {
+    const struct index_dir *x = a, *y = b;
+    return strcmp(index_sort_strings + x->path_off, index_sort_strings + y->path_off);
+}
+
+// Write the snapshot to file.tmp and rename it into place, so readers
+// never map a half-written index.
+int build_index(const char *file, const char *root) {
+    struct index_builder b;
+    memset(&b, 0, sizeof(b));
+
+    // Everything goes in: dot files, and directories --prune would skip.
+    int saved_show_all = show_all, saved_nprune = nprune;
+    show_all = 1;
+    nprune = 0;
+    index_scan(&b, root);
+    show_all = saved_show_all;
+    nprune = saved_nprune;
+    if (b.ndirs == 0)
+        return -1;
+
+    index_sort_strings = b.strings;
+    qsort(b.dirs, b.ndirs, sizeof(*b.dirs), index_dir_cmp);
+
+    struct index_header hdr;
+    memcpy(hdr.magic, INDEX_MAGIC, 8);
+    hdr.ndirs = b.ndirs;
+    hdr.nentries = b.nentries;
+    hdr.strings_size = b.strings_used;
+
+    size_t flen = strlen(file);
+    char *tmp = malloc(flen + 5);
+    memcpy(tmp, file, flen);
+    memcpy(tmp + flen, ".tmp", 5);
+
+    int status = 0;
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        perror(tmp);
+        status = -1;
+    } else {
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+        fwrite(b.dirs, sizeof(*b.dirs), b.ndirs, fp);
+        fwrite(b.entries, sizeof(*b.entries), b.nentries, fp);
+        fwrite(b.strings, 1, b.strings_used, fp);
+        if (ferror(fp) | fclose(fp) || rename(tmp, file) == -1) {
+            perror(file);
+            unlink(tmp);
+            status = -1;
+        }
+    }
+
+    // Directories that could not be read are simply missing from the
+    // index (--from-index reads them itself), but the index is
+    // incomplete and the exit status says so.
+    if (status == 0 && b.failed > 0) {
+        fprintf(stderr, "%s: %d directories could not be indexed\n", file, b.failed);
+        status = -1;
+    }
+
+    free(tmp);
+    free(b.dirs);
+    free(b.entries);
+    free(b.strings);
+    return status;
+}
+
+// A string of len bytes at off, NUL-terminated, inside the string table.
+int index_string_ok(const char *strings, uint64_t size, uint64_t off, uint64_t len) {
+    return off < size && len < size - off && strings[off + len] == '\0' &&
+           memchr(strings + off, '\0', len) == NULL;
+}
+
+// Every offset the readers follow without further checks: paths, names
+// and each directory's run of entries.
+int index_valid(const struct dir_index *ix, uint64_t strings_size) {
+    for (uint64_t i = 0; i < ix->ndirs; i++) {
+        const struct index_dir *d = &ix->dirs[i];
+        if (!index_string_ok(ix->strings, strings_size, d->path_off, d->path_len) ||
+            d->first > ix->nentries || d->nentries > ix->nentries - d->first)
+            return 0;
+    }
+    for (uint64_t i = 0; i < ix->nentries; i++) {
+        const struct index_entry *e = &ix->entries[i];
+        if (!index_string_ok(ix->strings, strings_size, e->name_off, e->name_len))
+            return 0;
+    }
+    return 1;
+}
+
+// Map an index and check that its tables fit in the file and that every
+// string it points to lies inside it; anything else is refused.
+struct dir_index *open_index(const char *file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(file);
+        return NULL;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct index_header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: not a usable index\n", file);
+        return NULL;
+    }
+
+    const struct index_header *hdr = map;
+    size_t size = st.st_size, avail = size - sizeof(*hdr);
+    if (memcmp(hdr->magic, INDEX_MAGIC, 8) != 0 ||
+        hdr->ndirs > avail / sizeof(struct index_dir) ||
+        hdr->nentries > (avail - hdr->ndirs * sizeof(struct index_dir)) / sizeof(struct index_entry) ||
+        hdr->strings_size != avail - hdr->ndirs * sizeof(struct index_dir)
+                                   - hdr->nentries * sizeof(struct index_entry)) {
+        fprintf(stderr, "%s: not a usable index\n", file);
+        munmap(map, size);
+        return NULL;
+    }
+
+    struct dir_index *ix = malloc(sizeof(*ix));
+    ix->dirs = (const struct index_dir *)(hdr + 1);
+    ix->entries = (const struct index_entry *)(ix->dirs + hdr->ndirs);
+    ix->strings = (const char *)(ix->entries + hdr->nentries);
+    ix->ndirs = hdr->ndirs;
+    ix->nentries = hdr->nentries;
+    if (!index_valid(ix, hdr->strings_size)) {
+        fprintf(stderr, "%s: not a usable index\n", file);
+        free(ix);
+        munmap(map, size);
+        return NULL;
+    }
+    return ix;
+}
+
+// Binary search of the path-sorted directory table.
+const struct index_dir *index_find(const struct dir_index *ix, const char *path) {
+    uint64_t lo = 0, hi = ix->ndirs;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(ix->strings + ix->dirs[mid].path_off, path);
+        if (c == 0) return &ix->dirs[mid];
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+// Fill list from the index if the directory open on dirfd is unchanged
+// since the snapshot; -1 means it has to be read.
+int index_listing(int dirfd, const char *path, struct dir_listing *list) {
+    const struct index_dir *d = index_find(active_index, path);
+    struct stat st;
+    int r = -1;
+
+    if (d) {
+        r = fstat(dirfd, &st);
+        prof.fstats++;
+    }
+    if (r == -1 ||
+        st.st_mtim.tv_sec != d->mtime_sec || st.st_mtim.tv_nsec != d->mtime_nsec ||
+        st.st_ino != d->ino || st.st_dev != d->dev) {
+        prof.index_misses++;
+        return -1;
+    }
+    prof.index_hits++;
+
+    memset(list, 0, sizeof(*list));
+    for (uint32_t i = 0; i < d->nentries; i++) {
+        const struct index_entry *e = &active_index->entries[d->first + i];
+        struct file_entry f;
+
+        memset(&f, 0, sizeof(f));
+        f.name = (char *)active_index->strings + e->name_off;
+        if (!is_listed(f.name)) continue;
+        f.len = e->name_len;
+        f.d_type = e->d_type;
+        f.have_stat = e->have_stat;
+        f.mode = e->mode;
+        f.size = e->size;
+        f.mtime = e->mtime;
+        f.mtime_nsec = e->mtime_nsec;
+        f.uid = e->uid;
+        f.gid = e->gid;
+        f.nlink = e->nlink;
+        f.ino = e->ino;
+        f.dev = e->dev;
+        if (colors.link_target && S_ISLNK(f.mode))
+            resolve_link_color(dirfd, &f);
+        listing_append(list, &f);
+    }
+    listing_finish(list);
+    prof.entries += list->count;
+    return 0;
+}
+
+// ================== Listing Daemon (--daemon, --socket) ==================
+// "lsv --daemon SOCKET" keeps the stat'ed, name-sorted listings of the
+// directories it has been asked for in memory and watches each one with
+// inotify; any change inside a directory (entries added, removed or
+// renamed, or a file's size, mode or times changing) drops its listing
+// and the next request reads it again. "lsv --socket SOCKET dir" sends
+// the request and prints what comes back, so a repeat listing of an
+// unchanged directory costs a round-trip plus rendering.
+//
+// A subdirectory's own nlink and mtime change when something is created
+// or removed inside it, and that raises no event on the parent's watch.
+// Listings that show attributes (-l, JSON, -t/-S) therefore re-stat the
+// subdirectory entries on every cache hit; plain listings need only the
+// names and types, which the watch does cover.
+//
+// Only plain single-directory listings are served: -R, -U/-f, --collate
+// and --from-index always read the directory in the client. Colors come
+// from the daemon's LS_COLORS. Times are formatted in the client's
+// timezone: the client sends its TZ, and one too long for the request
+// makes it list the directory itself. If the daemon is not running or
+// fails, the client silently lists the directory itself.
+#define DAEMON_MAGIC    0x4c535632u     // "LSV2"
+#define DAEMON_MAX_DIRS 4096            // cached listings, least recently used go first
+
+struct daemon_request {
+    uint32_t magic;
+    int32_t display_mode, sort_by, width;
+    int64_t head_limit;
+    char path[PATH_MAX];        // absolute; what the daemon opens and caches
+    char display[PATH_MAX];     // as given on the command line, for --json paths
+    int32_t has_tz;             // TZ is set in the client (even if empty)
+    char tz[256];
+};
+
+struct daemon_reply {
+    int32_t status;             // 0: len bytes of output follow
+    uint32_t pad;
+    uint64_t len;
+    uint64_t records;           // --json records in the output
+};
+
+// Full send/recv, -1 on error or a closed connection.
+int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int connect_socket(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// ---------- Client ----------
+// Have the daemon render dir into stdout_buf. Returns -1, with nothing
+// written, when the caller has to list the directory itself.
+int daemon_query(const char *socket_path, const char *dir, int display_mode) {
+    if (unsorted || collate || active_index || strlen(dir) >= PATH_MAX)
+        return -1;
+
+    struct daemon_request req;
+    memset(&req, 0, sizeof(req));
+    if (!realpath(dir, req.path))
+        return -1;
+    strcpy(req.display, dir);
+    req.magic = DAEMON_MAGIC;
+    req.display_mode = display_mode;
+    req.sort_by = sort_by;
+    req.width = get_terminal_width();
+    req.head_limit = head_limit;
+    const char *tz = getenv("TZ");
+    if (tz) {
+        if (strlen(tz) >= sizeof(req.tz))
+            return -1;
+        req.has_tz = 1;
+        strcpy(req.tz, tz);
+    }
+
+    int fd = connect_socket(socket_path);
+    if (fd == -1)
+        return -1;
+
+    // Collect the whole reply first so a daemon dying half-way through
+    // still leaves the client free to fall back.
+    struct daemon_reply reply;
+    struct outbuf body;
+    ob_init(&body, -1);
+    int status = -1;
+    if (send_all(fd, &req, sizeof(req)) == 0 &&
+        recv_all(fd, &reply, sizeof(reply)) == 0 && reply.status == 0) {
+        ob_reserve(&body, reply.len);
+        if (recv_all(fd, body.buf, reply.len) == 0) {
+            ob_write(&stdout_buf, body.buf, reply.len);
+            json_records = reply.records;
+            status = 0;
+        }
+    }
+    ob_free(&body);
+    close(fd);
+    return status;
+}
+
+// ---------- Daemon ----------
+#ifdef __linux__
+#define DAEMON_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                           IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | \
+                           IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct cached_dir {
+    char *path;
+    uint64_t hash;
+    int wd;                     // inotify watch
+    long last_used;
+    struct dir_listing list;    // every entry stat'ed, in name order
+};
+
+struct listing_cache {
+    struct cached_dir *dirs;
+    int count;
+    long clock;
+    int inotify_fd;
+};
+
+struct listing_cache cache;
+
+uint64_t path_hash(const char *s) {
+    uint64_t h = 14695981039346656037ULL;     // FNV-1a
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+void cache_drop(int i) {
+    struct cached_dir *d = &cache.dirs[i];
+    int shared = 0;
+
+    // Two paths can name one directory (bind mounts); its watch is
+    // shared and has to stay while either is cached.
+    for (int k = 0; k < cache.count; k++)
+        if (k != i && cache.dirs[k].wd == d->wd) shared = 1;
+    if (!shared)
+        inotify_rm_watch(cache.inotify_fd, d->wd);
+
+    free(d->path);
+    free_listing(&d->list);
+    cache.dirs[i] = cache.dirs[--cache.count];
+}
+
+// Read the directory into a new cache slot. The watch goes in before
+// the directory is read, so a change during the read is not lost.
+struct cached_dir *cache_load(const char *path, uint64_t hash) {
+    if (cache.count == DAEMON_MAX_DIRS) {
+        int oldest = 0;
+        for (int i = 1; i < cache.count; i++)
+            if (cache.dirs[i].last_used < cache.dirs[oldest].last_used) oldest = i;
+        cache_drop(oldest);
+    }
+
+    int fd = open_dir_at(AT_FDCWD, path);
+    if (fd == -1)
+        return NULL;
+    int wd = inotify_add_watch(cache.inotify_fd, path, DAEMON_WATCH_MASK | IN_ONLYDIR);
+    struct dir_listing list;
+    if (wd == -1 || gather_filenames(fd, &list) == -1) {
+        if (wd == -1) perror("inotify_add_watch");
+        close(fd);
+        return NULL;
+    }
+    stat_entries(fd, list.files, list.count, STAT_FULL);
+    sort_entries(&list);
+    close(fd);
+
+    struct cached_dir *d = &cache.dirs[cache.count++];
+    d->path = strdup(path);
+    d->hash = hash;
+    d->wd = wd;
+    d->list = list;
+    return d;
+}
+
+// See the section comment: the watch does not see a subdirectory's own
+// attributes change.
+void cache_refresh_subdirs(struct cached_dir *d) {
+    int fd = open_dir_at(AT_FDCWD, d->path);
+    if (fd == -1)
+        return;
+    for (int i = 0; i < d->list.count; i++)
+        if (S_ISDIR(d->list.files[i].mode))
+            stat_entry(fd, &d->list.files[i], STAT_FULL);
+    close(fd);
+}
+
+// The listing of path; with refresh, a cached one gets its subdirectory
+// entries re-stat'ed.
+struct cached_dir *cache_get(const char *path, int refresh) {
+    uint64_t hash = path_hash(path);
+    struct cached_dir *d = NULL;
+
+    for (int i = 0; i < cache.count && !d; i++)
+        if (cache.dirs[i].hash == hash && strcmp(cache.dirs[i].path, path) == 0)
+            d = &cache.dirs[i];
+    if (d && refresh)
+        cache_refresh_subdirs(d);
+    if (!d)
+        d = cache_load(path, hash);
+    if (d)
+        d->last_used = ++cache.clock;
+    return d;
+}
+
+// Drop every listing an inotify event touches.
+void cache_invalidate(void) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while ((n = read(cache.inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                while (cache.count > 0) cache_drop(0);
+                continue;
+            }
+            for (int i = cache.count - 1; i >= 0; i--)
+                if (cache.dirs[i].wd == ev->wd) cache_drop(i);
+        }
+    }
+}
+
+// Switch the daemon to the client's TZ (NULL: unset). The cached day of
+// format_mtime belongs to the old zone and is dropped with it.
+void use_client_tz(const char *tz) {
+    const char *cur = getenv("TZ");
+    if (tz == cur || (tz && cur && strcmp(tz, cur) == 0))
+        return;
+    if (tz)
+        setenv("TZ", tz, 1);
+    else
+        unsetenv("TZ");
+    tzset();
+    memset(&mtime_cache, 0, sizeof(mtime_cache));
+}
+
+void daemon_serve(int client) {
+    struct daemon_request req;
+    struct daemon_reply reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.status = -1;
+    if (recv_all(client, &req, sizeof(req)) == -1 || req.magic != DAEMON_MAGIC)
+        return;
+    req.path[PATH_MAX - 1] = req.display[PATH_MAX - 1] = '\0';
+    req.tz[sizeof(req.tz) - 1] = '\0';
+
+    sort_by = req.sort_by;
+    head_limit = req.head_limit;
+    term_width = req.width;
+    use_client_tz(req.has_tz ? req.tz : NULL);
+    now_time = time(NULL);
+    json_records = 0;
+
+    // Changes that happened before this request must not be served.
+    cache_invalidate();
+    struct cached_dir *d = cache_get(req.path, stat_need(req.display_mode) == STAT_FULL);
+    if (!d) {
+        send_all(client, &reply, sizeof(reply));
+        return;
+    }
+
+    // The cached listing is in name order already; other orders sort a
+    // copy of the records (the names stay in the cached arena).
+    struct outbuf out;
+    ob_init(&out, -1);
+    if (sort_by == SORT_NAME) {
+        int count = d->list.count;
+        if (head_limit > 0 && head_limit < count) count = head_limit;
+        display_entries(&out, req.display, req.display_mode, d->list.files, count);
+    } else {
+        struct dir_listing view = d->list;
+        view.files = malloc(view.count * sizeof(*view.files));
+        memcpy(view.files, d->list.files, view.count * sizeof(*view.files));
+        view.names = NULL;
+        sort_listing(&view);
+        display_entries(&out, req.display, req.display_mode, view.files, view.count);
+        free(view.files);
+    }
+
+    reply.status = 0;
+    reply.len = out.len;
+    reply.records = json_records;
+    if (send_all(client, &reply, sizeof(reply)) == 0)
+        send_all(client, out.buf, out.len);
+    ob_free(&out);
+}
+
+// Make socket_path free for bind. Only a stale socket, one nobody is
+// listening on any more, is removed: a regular file or a running
+// daemon's socket is left alone and the daemon refuses to start.
+int claim_socket_path(const char *socket_path) {
+    struct stat st;
+    if (lstat(socket_path, &st) == -1) {
+        if (errno == ENOENT) return 0;
+        perror(socket_path);
+        return -1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "%s: exists and is not a socket\n", socket_path);
+        return -1;
+    }
+    int fd = connect_socket(socket_path);
+    if (fd != -1) {
+        close(fd);
+        fprintf(stderr, "%s: a daemon is already listening\n", socket_path);
+        return -1;
+    }
+    if (unlink(socket_path) == -1) {
+        perror(socket_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Serve clients one at a time until killed.
+int run_daemon(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    if (claim_socket_path(socket_path) == -1)
+        return 1;
+
+    cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache.inotify_fd == -1) {
+        perror("inotify_init1");
+        return 1;
+    }
+    cache.dirs = malloc(DAEMON_MAX_DIRS * sizeof(*cache.dirs));
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(lfd, 64) == -1) {
+        perror(socket_path);
+        return 1;
+    }
+    tzset();
+
+    // A client that stalls must not hang the daemon for everyone.
+    struct timeval timeout = { 2, 0 };
+    struct pollfd fds[2] = {
+        { .fd = lfd, .events = POLLIN },
+        { .fd = cache.inotify_fd, .events = POLLIN },
+    };
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+        if (fds[1].revents & POLLIN)
+            cache_invalidate();
+        if (fds[0].revents & POLLIN) {
+            int client = accept(lfd, NULL, NULL);
+            if (client == -1) continue;
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            daemon_serve(client);
+            close(client);
+        }
+    }
+}
+#else
+int run_daemon(const char *socket_path) {
+    (void)socket_path;
+    fprintf(stderr, "--daemon needs inotify (Linux only)\n");
+    return 1;
 }
+#endif